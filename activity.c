@@ -0,0 +1,190 @@
+/* PiTabDaemon - Input Activity Tracking */
+
+/* Copyright (c) 2017 by Stefan Vorkoetter
+
+   This file is part of PiTabDaemon.
+
+   PiTabDaemon is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   PiTabDaemon is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with PiTabDaemon. If not, see <http://www.gnu.org/licenses/>. */
+
+#define _GNU_SOURCE
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/inotify.h>
+#include <sys/ioctl.h>
+#include <linux/input.h>
+
+#include "activity.h"
+#include "sched.h"
+
+/* User activity is anything that arrives from the touchscreen, keyboards, or
+   mice, whether or not X is running. Each input device under /dev/input is
+   kept open and watched, along with the directory itself so that devices
+   plugged in later are picked up. The devices and directory are watched by
+   an epoll set of our own, whose descriptor is the one the scheduler waits
+   on, since devices come and go. The kernel timestamps input events on the
+   monotonic clock (once asked to), so the time of the last activity is known
+   exactly without having to look at the clock. */
+
+#define INPUT_DIR "/dev/input"
+#define MAX_DEVICES 16
+
+static int devices[MAX_DEVICES];
+static int numDevices = 0;
+
+static int epollFd = -1, inotifyFd = -1;
+static int64_t lastActivity = -1;
+
+/* Test a bit in a capability bitmap returned by EVIOCGBIT. */
+static bool testBit( const unsigned long *bits, int bit )
+{
+    const int BITS = 8 * sizeof(long);
+    return( bits[bit / BITS] >> (bit % BITS) & 1 );
+}
+
+/* Start watching an input device, if it's one a user can generate activity
+   on (keys, buttons, pointer motion, or touches). */
+static void openDevice( const char *name )
+{
+    if( strncmp(name,"event",5) != 0 || numDevices >= MAX_DEVICES )
+	return;
+
+    char path[sizeof(INPUT_DIR) + 256];
+    snprintf(path,sizeof(path),INPUT_DIR "/%s",name);
+    int fd = open(path,O_RDONLY | O_NONBLOCK | O_CLOEXEC);
+    if( fd < 0 )
+	return;
+
+    unsigned long types[1] = { 0 };
+    int clock = CLOCK_MONOTONIC;
+    struct epoll_event ev = { .events = EPOLLIN, .data.fd = fd };
+    if( ioctl(fd,EVIOCGBIT(0,sizeof(types)),types) < 0
+     || !(testBit(types,EV_KEY) || testBit(types,EV_REL)
+	  || testBit(types,EV_ABS))
+     || ioctl(fd,EVIOCSCLOCKID,&clock) < 0
+     || epoll_ctl(epollFd,EPOLL_CTL_ADD,fd,&ev) < 0 ) {
+	close(fd);
+	return;
+    }
+    devices[numDevices++] = fd;
+}
+
+/* Stop watching a device that has gone away. */
+static void closeDevice( int fd )
+{
+    for( int i = 0; i < numDevices; ++i ) {
+	if( devices[i] == fd ) {
+	    devices[i] = devices[--numDevices];
+	    break;
+	}
+    }
+    close(fd);
+}
+
+/* Read the events waiting on a device, remembering when the latest one that
+   came from the user happened. */
+static void readDevice( int fd )
+{
+    struct input_event events[64];
+    ssize_t n;
+    while( (n = read(fd,events,sizeof(events))) > 0 ) {
+	for( int i = n / sizeof(events[0]); i-- > 0; ) {
+	    int type = events[i].type;
+	    if( type == EV_KEY || type == EV_REL || type == EV_ABS ) {
+		int64_t t = (int64_t) events[i].input_event_sec * 1000
+			  + events[i].input_event_usec / 1000;
+		if( t > lastActivity )
+		    lastActivity = t;
+		break;
+	    }
+	}
+    }
+    if( n < 0 && errno != EAGAIN )
+	closeDevice(fd);
+}
+
+/* Open any devices that have been added to the input directory. */
+static void readDirectory( void )
+{
+    char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+    ssize_t n;
+    while( (n = read(inotifyFd,buf,sizeof(buf))) > 0 ) {
+	for( char *p = buf; p < buf + n; ) {
+	    struct inotify_event *ev = (struct inotify_event *) p;
+	    if( ev->len > 0 )
+		openDevice(ev->name);
+	    p += sizeof(struct inotify_event) + ev->len;
+	}
+    }
+}
+
+bool InitActivity( void )
+{
+    if( (epollFd = epoll_create1(EPOLL_CLOEXEC)) < 0
+     || (inotifyFd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC)) < 0
+     || inotify_add_watch(inotifyFd,INPUT_DIR,IN_CREATE) < 0 )
+	return( false );
+
+    struct epoll_event ev = { .events = EPOLLIN, .data.fd = inotifyFd };
+    if( epoll_ctl(epollFd,EPOLL_CTL_ADD,inotifyFd,&ev) < 0 )
+	return( false );
+
+    /* Open the devices that are already there. */
+    DIR *dir = opendir(INPUT_DIR);
+    if( dir == NULL )
+	return( false );
+    struct dirent *entry;
+    while( (entry = readdir(dir)) != NULL )
+	openDevice(entry->d_name);
+    closedir(dir);
+
+    lastActivity = NowMs();
+    return( true );
+}
+
+int GetActivityFd( void )
+{
+    return( epollFd );
+}
+
+void ReadActivity( void )
+{
+    struct epoll_event events[MAX_DEVICES+1];
+    int n = epoll_wait(epollFd,events,MAX_DEVICES+1,0);
+    for( int i = 0; i < n; ++i ) {
+	if( events[i].data.fd == inotifyFd )
+	    readDirectory();
+	else
+	    readDevice(events[i].data.fd);
+    }
+}
+
+void NoteActivity( int64_t time )
+{
+    if( time > lastActivity )
+	lastActivity = time;
+}
+
+int64_t LastActivity( void )
+{
+    return( lastActivity );
+}
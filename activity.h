@@ -0,0 +1,41 @@
+/* PiTabDaemon - Input Activity Tracking */
+
+/* Copyright (c) 2017 by Stefan Vorkoetter
+
+   This file is part of PiTabDaemon.
+
+   PiTabDaemon is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   PiTabDaemon is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with PiTabDaemon. If not, see <http://www.gnu.org/licenses/>. */
+
+#ifndef __PI_TAB_DAEMON_ACTIVITY_H__
+#define __PI_TAB_DAEMON_ACTIVITY_H__
+
+/* Start watching the input devices (and for new ones). Returns false if the
+   input directory can't be watched. */
+extern bool InitActivity( void );
+
+/* Return a descriptor that becomes readable when there is input, and read
+   it, noting the time of any user activity. */
+extern int GetActivityFd( void );
+extern void ReadActivity( void );
+
+/* Return the time in ms on the monotonic clock (see NowMs) of the most
+   recent user activity, or of starting to watch for it if there hasn't been
+   any, or -1 if input devices aren't being watched. */
+extern int64_t LastActivity( void );
+
+/* Note user activity that wasn't seen on an input device, such as a touch
+   in a trace being replayed (see replay.h). */
+extern void NoteActivity( int64_t time );
+
+#endif
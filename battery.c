@@ -17,11 +17,17 @@
    You should have received a copy of the GNU General Public License
    along with PiTabDaemon. If not, see <http://www.gnu.org/licenses/>. */
 
+#define _GNU_SOURCE
+#include <math.h>
 #include <stdbool.h>
 #include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
 
 #include "battery.h"
 #include "io.h"
+#include "replay.h"
 
 /* The battery monitoring input is a single pin, driven by a comparator that
    compares 0.69 times the battery voltage against a triangle wave that
@@ -47,44 +53,544 @@ const double FULL = 0.707, FULL_ENERGY =  1.00;
    internal resistance. */
 #define CHARGE_DELTA (0.2 / (VOLTAGE_AT_1 - VOLTAGE_AT_0))
 
-static uint8_t batterySamples[BATTERY_SAMPLES];
-static unsigned int nextSampleIndex, sampleTotal, chargingSampleTotal;
+#if BATTERY_SAMPLES & (BATTERY_SAMPLES - 1) || BATTERY_SAMPLES < 256
+#error BATTERY_SAMPLES must be a power of two, and at least 256
+#endif
 
-void InitBattery( void )
+/* Estimators
+
+   The samples can be turned into a reading in more than one way. Each
+   estimator is given every sample, along with whether the charger was
+   connected, and reports its estimate as a number of samples, how many of
+   those were ones, and how many were ones with the charger connected. These
+   needn't be whole numbers. An estimator also specifies how many samples it
+   needs to have seen before its estimate is accurate enough to use, and where
+   its state is, so that it can be saved and restored.
+
+   Instead of being given one sample at a time, an estimator can take its
+   own samples each time a reading is asked for, returning whether it has a
+   new estimate. Readings are then only asked for about every interval ms
+   (see GetBatteryReadingDelay), and its ready count is a number of new
+   estimates. Such an estimator may measure the edges of the input reported
+   by the GPIO character device instead of reading it. */
+
+struct Estimator {
+    const char *name;
+    void (*init)( void );
+    void (*add)( bool sample, bool charging );
+    bool (*sample)( bool charging );
+    double (*estimate)( double *ones, double *chargingOnes );
+    unsigned int readySamples;
+    void *state;
+    size_t stateSize;
+    int interval;
+    bool edges;
+};
+
+/* Boxcar: the average of exactly the last BATTERY_SAMPLES samples.
+
+   Each sample is stored as a single bit, along with a second bit recording
+   whether the charger was connected when it was a one, so the whole window
+   stays small even when BATTERY_SAMPLES is made large. Running totals are
+   maintained as samples enter and leave the window, and recounted from the
+   bits each time the window wraps around in case they have gone astray. The
+   window starts out full of fake samples, so it isn't ready until they have
+   all been replaced. */
+
+#define SAMPLE_WORDS (BATTERY_SAMPLES / 32)
+
+static struct {
+    uint32_t sampleBits[SAMPLE_WORDS], chargingBits[SAMPLE_WORDS];
+    unsigned int nextSampleIndex, sampleTotal, chargingSampleTotal;
+} boxcar;
+
+/* Recompute the totals from the bits in the window. */
+static void countSamples( void )
 {
-    for( int i = 0; i < BATTERY_SAMPLES; ++i )
-        batterySamples[i] = i & 1;
-    nextSampleIndex = 0;
-    sampleTotal = BATTERY_SAMPLES / 2;
-    chargingSampleTotal = 0;
+    boxcar.sampleTotal = boxcar.chargingSampleTotal = 0;
+    for( int i = 0; i < SAMPLE_WORDS; ++i ) {
+	boxcar.sampleTotal += __builtin_popcount(boxcar.sampleBits[i]);
+	boxcar.chargingSampleTotal += __builtin_popcount(boxcar.chargingBits[i]);
+    }
 }
 
-double GetRawBatteryReadings( bool charging, double *rAdj )
+static void boxcarInit( void )
 {
+    /* Start with alternating ones and zeroes (i.e. a 50% reading). */
+    for( int i = 0; i < SAMPLE_WORDS; ++i ) {
+	boxcar.sampleBits[i] = 0xAAAAAAAA;
+	boxcar.chargingBits[i] = 0;
+    }
+    boxcar.nextSampleIndex = 0;
+    countSamples();
+}
+
+static void boxcarAdd( bool sample, bool charging )
+{
+    unsigned int i = boxcar.nextSampleIndex;
+    uint32_t *sampleWord = &boxcar.sampleBits[i / 32];
+    uint32_t *chargingWord = &boxcar.chargingBits[i / 32];
+    uint32_t bit = 1U << i % 32;
+
     /* Remove the sample we're about to throw away from the total. */
-    sampleTotal -= batterySamples[nextSampleIndex] & 1;
-    chargingSampleTotal -= (batterySamples[nextSampleIndex] & 2) >> 1;
+    boxcar.sampleTotal -= (*sampleWord & bit) != 0;
+    boxcar.chargingSampleTotal -= (*chargingWord & bit) != 0;
+    *sampleWord &= ~bit;
+    *chargingWord &= ~bit;
+
+    /* Add the new sample to the total. */
+    if( sample ) {
+	*sampleWord |= bit;
+	++boxcar.sampleTotal;
+	if( charging ) {
+	    *chargingWord |= bit;
+	    ++boxcar.chargingSampleTotal;
+	}
+    }
+
+    /* Compute the index of the next sample, and recount the totals whenever
+       we get back to the start of the window. */
+    boxcar.nextSampleIndex = (i + 1) & (BATTERY_SAMPLES - 1);
+    if( boxcar.nextSampleIndex == 0 )
+	countSamples();
+}
+
+static double boxcarEstimate( double *ones, double *chargingOnes )
+{
+    *ones = boxcar.sampleTotal;
+    *chargingOnes = boxcar.chargingSampleTotal;
+    return( BATTERY_SAMPLES );
+}
 
-    /* Sample the battery monitor input and add it to the total. */
-    if( GetBatterySample() ) {
-        batterySamples[nextSampleIndex] = charging ? 3 : 1;
-	++sampleTotal;
-	if( charging ) ++chargingSampleTotal;
+/* CIC: a moving average decimator. Samples are counted in blocks of
+   CIC_DECIMATION, and the estimate is the average of the most recent
+   BATTERY_SAMPLES / CIC_DECIMATION complete blocks, or of however many there
+   are so far. This covers the same window as the boxcar in a fraction of the
+   memory, updates only once per block, and needs no fake samples, so it can
+   be used as soon as a few blocks have been collected. */
+
+#define CIC_DECIMATION 256
+#define CIC_BLOCKS (BATTERY_SAMPLES / CIC_DECIMATION)
+
+static struct {
+    uint16_t blockOnes[CIC_BLOCKS], blockChargingOnes[CIC_BLOCKS];
+    unsigned int blockIndex, numBlocks, blockSamples;
+    unsigned int partialOnes, partialChargingOnes;
+    unsigned int ones, chargingOnes;
+} cic;
+
+static void cicInit( void )
+{
+    cic.blockIndex = cic.numBlocks = cic.blockSamples = 0;
+    cic.partialOnes = cic.partialChargingOnes = 0;
+    cic.ones = cic.chargingOnes = 0;
+}
+
+static void cicAdd( bool sample, bool charging )
+{
+    /* Integrate the sample into the current block. */
+    cic.partialOnes += sample;
+    cic.partialChargingOnes += sample && charging;
+    if( ++cic.blockSamples < CIC_DECIMATION )
+	return;
+
+    /* The block is complete, so replace the oldest block with it. */
+    if( cic.numBlocks == CIC_BLOCKS ) {
+	cic.ones -= cic.blockOnes[cic.blockIndex];
+	cic.chargingOnes -= cic.blockChargingOnes[cic.blockIndex];
     }
     else
-        batterySamples[nextSampleIndex] = 0;
+	++cic.numBlocks;
+    cic.blockOnes[cic.blockIndex] = cic.partialOnes;
+    cic.blockChargingOnes[cic.blockIndex] = cic.partialChargingOnes;
+    cic.ones += cic.partialOnes;
+    cic.chargingOnes += cic.partialChargingOnes;
+    cic.blockIndex = (cic.blockIndex + 1) % CIC_BLOCKS;
+
+    cic.blockSamples = cic.partialOnes = cic.partialChargingOnes = 0;
+}
+
+static double cicEstimate( double *ones, double *chargingOnes )
+{
+    /* Until the first block is complete, use the partial block. */
+    if( cic.numBlocks == 0 ) {
+	*ones = cic.partialOnes;
+	*chargingOnes = cic.partialChargingOnes;
+	return( cic.blockSamples > 0 ? cic.blockSamples : 1 );
+    }
+    *ones = cic.ones;
+    *chargingOnes = cic.chargingOnes;
+    return( cic.numBlocks * CIC_DECIMATION );
+}
+
+/* Adaptive: an exponential average whose gain starts at 1 and falls as 1/n,
+   which makes it the exact average of all samples so far (the Kalman gain for
+   estimating a constant), until it reaches a floor at which its noise matches
+   that of the boxcar. From then on it tracks changes in the battery voltage
+   as an exponential average with the same effective window. */
+
+#define ADAPTIVE_MIN_GAIN (2.0 / (BATTERY_SAMPLES + 1))
+
+static struct {
+    double level, chargingLevel;
+    unsigned int samples;
+} adaptive;
+
+static void adaptiveInit( void )
+{
+    adaptive.level = adaptive.chargingLevel = 0;
+    adaptive.samples = 0;
+}
+
+static void adaptiveAdd( bool sample, bool charging )
+{
+    double gain = ADAPTIVE_MIN_GAIN;
+    if( adaptive.samples < BATTERY_SAMPLES ) {
+	++adaptive.samples;
+	if( 1.0 / adaptive.samples > gain )
+	    gain = 1.0 / adaptive.samples;
+    }
+    adaptive.level += gain * (sample - adaptive.level);
+    adaptive.chargingLevel += gain * ((sample && charging)
+				      - adaptive.chargingLevel);
+}
+
+static double adaptiveEstimate( double *ones, double *chargingOnes )
+{
+    *ones = adaptive.level;
+    *chargingOnes = adaptive.chargingLevel;
+    return( 1.0 );
+}
+
+/* Burst: every BATTERY_BURST_INTERVAL ms or so, read the input as fast as
+   possible for one whole period of the triangle wave, from one edge to the
+   next edge in the same direction, and take the fraction of that time during
+   which it was one. Sampling a whole period at once measures the duty cycle
+   far more precisely than the same time spent taking one sample every
+   millisecond, and needs only a few wake-ups a second, each of which keeps
+   the CPU busy for one to one and a half periods (10 to 15ms). Unless the
+   inputs come from the GPIO character device, though, they still have to be
+   scanned every millisecond, so there are just as many wake-ups as before.
+
+   An edge only ends the period if it comes at least BURST_MIN_PERIOD after
+   the first, so that the comparator chattering as it switches in the other
+   direction doesn't end it early; this is longer than the input spends high
+   or low at any duty cycle from 20 to 80%, which covers every battery
+   reading. If there are no such edges within BURST_SPAN (because the input
+   isn't changing at all), the whole burst is used instead.
+
+   Each reading is weighted by how long it was until the next one, so that
+   irregular reads don't bias the result, but by no more than BURST_MAX_READ,
+   so that if the thread is preempted mid-burst, one reading doesn't stand in
+   for the whole gap. A burst whose readings end up covering less of its time
+   counts for less.
+
+   The intervals between bursts are dithered (by GetBatteryReadingDelay), so
+   that they start at random phases of the triangle wave rather than beating
+   against it. The bursts are averaged in the same way as by the adaptive
+   estimator, with an effective window the same length of time as that of the
+   boxcar.
+
+   When replaying a trace, time doesn't pass while sampling, so a clock that
+   advances by BURST_REPLAY_READ per reading is used instead. */
+
+#define BURST_SPAN 20000000 /* ns */
+#define BURST_MIN_PERIOD 8000000 /* ns */
+#define BURST_MAX_READ 20000 /* ns */
+#define BURST_REPLAY_READ 10000 /* ns */
+#define BURST_WINDOW (BATTERY_SAMPLES / BATTERY_BURST_INTERVAL)
+#define BURST_MIN_GAIN (2.0 / (BURST_WINDOW + 1))
+
+static struct {
+    double level, chargingLevel;
+    unsigned int bursts;
+} burst;
+
+/* Where samples come from, and what time it is while taking them (in ns).
+   These are replaced when replaying, and by CompareBatterySampling. */
+static bool (*readSample)( void ) = GetBatterySample;
+static int64_t (*readClock)( void );
+
+static int64_t monotonicClock( void )
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC,&ts);
+    return( ts.tv_sec * 1000000000LL + ts.tv_nsec );
+}
+
+static int64_t replayClock( void )
+{
+    static int64_t ns = 0;
+    return( ns += BURST_REPLAY_READ );
+}
+
+static void burstInit( void )
+{
+    burst.level = burst.chargingLevel = 0;
+    burst.bursts = 0;
+}
+
+static bool burstAdd( bool charging )
+{
+    if( readClock == NULL )
+	readClock = Replaying() ? replayClock : monotonicClock;
+    /* Total weight and weight of ones so far, and at the first edge. */
+    int64_t start = readClock(), end = start + BURST_SPAN, t = start;
+    int64_t total = 0, ones = 0, edgeTime = 0, edgeTotal = 0, edgeOnes = 0;
+    bool previous = readSample(), edge = false, rising = false;
+    while( t < end ) {
+	bool sample = readSample();
+	int64_t next = readClock();
+	int64_t weight = next - t < BURST_MAX_READ ? next - t : BURST_MAX_READ;
+	if( sample != previous ) {
+	    if( !edge ) {
+		edge = true;
+		rising = sample;
+		edgeTime = t;
+		edgeTotal = total;
+		edgeOnes = ones;
+	    }
+	    else if( sample == rising && t - edgeTime >= BURST_MIN_PERIOD ) {
+		start = edgeTime;
+		total -= edgeTotal;
+		ones -= edgeOnes;
+		break;
+	    }
+	    previous = sample;
+	}
+	total += weight;
+	ones += sample ? weight : 0;
+	t = next;
+    }
+
+    double fraction = total > 0 ? (double) ones / total : burst.level;
+    double gain = BURST_MIN_GAIN;
+    if( burst.bursts < BURST_WINDOW ) {
+	++burst.bursts;
+	if( 1.0 / burst.bursts > gain )
+	    gain = 1.0 / burst.bursts;
+    }
+    if( total < t - start )
+	gain *= (double) total / (t - start);
+    burst.level += gain * (fraction - burst.level);
+    burst.chargingLevel += gain * ((charging ? fraction : 0)
+				   - burst.chargingLevel);
+    return( true );
+}
+
+static double burstEstimate( double *ones, double *chargingOnes )
+{
+    *ones = burst.level;
+    *chargingOnes = burst.chargingLevel;
+    return( 1.0 );
+}
+
+/* Edges: instead of sampling the input, have the GPIO character device report
+   each of its edges, timestamped by the kernel in ns, and add up the time
+   spent high and the total time over a number of whole periods (from rising
+   edge to rising edge), giving the exact duty cycle over that time. At the
+   comparator's 100Hz this takes about 200 interrupts a second. The edges are
+   collected from the kernel every EDGE_READ_INTERVAL ms or so, within the
+   BATTERY_EDGE_EVENTS it can hold.
+
+   If an edge is missing, as shown by a gap in the kernel's sequence numbers
+   or by two edges in a row in the same direction, the periods measured so far
+   are discarded, and measuring starts again at the next rising edge. The last
+   complete measurement is the reading. */
+
+#define EDGE_READ_INTERVAL 50
+#define EDGE_PERIODS 25
+
+static int edgePeriods = EDGE_PERIODS;
+
+static struct {
+    double level, chargingLevel;
+    int64_t lastTime, highTime, totalTime;
+    uint32_t lastSeqno;
+    int periods;
+    bool lastRising, counting;
+} edges;
+
+/* Where edges come from. This is replaced by CompareBatterySampling. */
+static bool (*readEdge)( int64_t *time, bool *rising, uint32_t *seqno )
+    = ReadBatteryEdge;
+
+static void edgesInit( void )
+{
+    memset(&edges,0,sizeof(edges));
+}
+
+static bool edgesAdd( bool charging )
+{
+    int64_t time;
+    uint32_t seqno;
+    bool rising, measured = false;
+    while( readEdge(&time,&rising,&seqno) ) {
+	bool consecutive = seqno == edges.lastSeqno + 1
+			&& rising != edges.lastRising && time > edges.lastTime;
+	if( !consecutive )
+	    edges.counting = false;
+	else if( edges.counting ) {
+	    /* A falling edge ends a high interval, and a rising one a period. */
+	    if( !rising )
+		edges.highTime += time - edges.lastTime;
+	    edges.totalTime += time - edges.lastTime;
+	    if( rising && ++edges.periods >= edgePeriods ) {
+		edges.level = (double) edges.highTime / edges.totalTime;
+		edges.chargingLevel = charging ? edges.level : 0;
+		edges.counting = false;
+		measured = true;
+	    }
+	}
+	if( rising && !edges.counting ) {
+	    edges.counting = true;
+	    edges.highTime = edges.totalTime = 0;
+	    edges.periods = 0;
+	}
+	edges.lastTime = time;
+	edges.lastSeqno = seqno;
+	edges.lastRising = rising;
+    }
+    return( measured );
+}
+
+static double edgesEstimate( double *ones, double *chargingOnes )
+{
+    *ones = edges.level;
+    *chargingOnes = edges.chargingLevel;
+    return( 1.0 );
+}
+
+static const struct Estimator ESTIMATORS[] = {
+    { "boxcar", boxcarInit, boxcarAdd, NULL, boxcarEstimate, BATTERY_SAMPLES,
+      &boxcar, sizeof(boxcar), 0, false },
+    { "cic", cicInit, cicAdd, NULL, cicEstimate, 8 * CIC_DECIMATION,
+      &cic, sizeof(cic), 0, false },
+    { "adaptive", adaptiveInit, adaptiveAdd, NULL, adaptiveEstimate, 256,
+      &adaptive, sizeof(adaptive), 0, false },
+    { "burst", burstInit, NULL, burstAdd, burstEstimate, 4,
+      &burst, sizeof(burst), BATTERY_BURST_INTERVAL, false },
+    { "edges", edgesInit, NULL, edgesAdd, edgesEstimate, 1,
+      &edges, sizeof(edges), EDGE_READ_INTERVAL, true }
+};
+static const int NUM_ESTIMATORS = sizeof(ESTIMATORS) / sizeof(struct Estimator);
+
+static const struct Estimator *estimator = &ESTIMATORS[2];
+static unsigned int samplesTaken;
 
-    /* Compute the index of the next sample. */
-    nextSampleIndex = (nextSampleIndex + 1) % BATTERY_SAMPLES;
+/* State of the random number generator used to dither the bursts. This is
+   always started from the same seed, so that replays are repeatable. */
+static uint32_t randomState = 1;
+
+static uint32_t nextRandom( void )
+{
+    randomState ^= randomState << 13;
+    randomState ^= randomState >> 17;
+    randomState ^= randomState << 5;
+    return( randomState );
+}
+
+/* -------------------------------- Readings -------------------------------- */
+
+bool SetBatteryEstimator( const char *name )
+{
+    for( int i = 0; i < NUM_ESTIMATORS; ++i ) {
+	if( strcmp(ESTIMATORS[i].name,name) == 0 ) {
+	    estimator = &ESTIMATORS[i];
+	    return( true );
+	}
+    }
+    return( false );
+}
+
+int GetBatteryReadingDelay( void )
+{
+    int interval = estimator->interval;
+    if( interval == 0 )
+	return( 0 );
+    return( interval / 2 + nextRandom() % interval );
+}
+
+bool BatteryNeedsEdges( void )
+{
+    return( estimator->edges );
+}
+
+bool SetBatteryEdgePeriods( int periods )
+{
+    if( periods < 1 )
+	return( false );
+    edgePeriods = periods;
+    return( true );
+}
+
+void InitBattery( void )
+{
+    estimator->init();
+    samplesTaken = 0;
+}
+
+bool BatteryReadingsReady( void )
+{
+    return( samplesTaken >= estimator->readySamples );
+}
+
+/* Save the state of the estimator, so that readings can continue where they
+   left off after the daemon is restarted. */
+bool WriteBatteryState( FILE *fp )
+{
+    uint32_t size = estimator->stateSize;
+    return( fwrite(estimator->name,1,strlen(estimator->name)+1,fp)
+	    == strlen(estimator->name)+1
+	 && fwrite(&size,sizeof(size),1,fp) == 1
+	 && fwrite(estimator->state,estimator->stateSize,1,fp) == 1
+	 && fwrite(&samplesTaken,sizeof(samplesTaken),1,fp) == 1 );
+}
+
+/* Restore the state saved by WriteBatteryState. If it was saved by a
+   different estimator, or can't be read, the estimator is reinitialized and
+   false is returned. */
+bool ReadBatteryState( FILE *fp )
+{
+    char name[16];
+    int i = 0, c;
+    while( (c = fgetc(fp)) > 0 && i < sizeof(name) - 1 )
+	name[i++] = c;
+    name[i] = '\0';
+
+    uint32_t size;
+    if( c != 0 || strcmp(name,estimator->name) != 0
+     || fread(&size,sizeof(size),1,fp) != 1 || size != estimator->stateSize
+     || fread(estimator->state,estimator->stateSize,1,fp) != 1
+     || fread(&samplesTaken,sizeof(samplesTaken),1,fp) != 1 )
+    {
+	InitBattery();
+	return( false );
+    }
+    return( true );
+}
+
+double GetRawBatteryReadings( bool charging, double *rAdj )
+{
+    /* Sample the battery monitor input and pass it to the estimator, or have
+       the estimator take its own samples. */
+    bool taken = true;
+    if( estimator->sample != NULL )
+	taken = estimator->sample(charging);
+    else
+	estimator->add(readSample(),charging);
+    if( taken && samplesTaken < estimator->readySamples )
+	++samplesTaken;
 
     /* Compute two averages, one corresponding to the actual measured voltage,
        and one adjusted for the charger being connected. */
-    double rAct = (double) sampleTotal / BATTERY_SAMPLES;
+    double ones, chargingOnes, count = estimator->estimate(&ones,&chargingOnes);
+    double rAct = ones / count;
 
     double delta = CHARGE_DELTA;
     if( rAct > KNEE2 )
-        delta *= (FULL - rAct) / (FULL - KNEE2);
-    *rAdj = (sampleTotal - delta * chargingSampleTotal) / BATTERY_SAMPLES;
+	delta *= (FULL - rAct) / (FULL - KNEE2);
+    *rAdj = (ones - delta * chargingOnes) / count;
 
     /* Return the unadjusted actual reading. */
     return( rAct );
@@ -109,3 +615,227 @@ double BatteryRawToEnergyRemaining( double rAdj )
     if( e < 0 ) e = 0; else if( e > 1 ) e = 1;
     return( e * 100.0 );
 }
+
+/* ------------------------------- Comparison ------------------------------- */
+
+/* The estimators are compared by running them on a simulated comparator: a
+   triangle wave with a random phase, compared against a fixed level with a
+   little noise. The sample-at-a-time estimators are given a sample every
+   millisecond, give or take the scan thread's jitter, and bursts read the
+   input every SIM_READ ns, about as fast as a GPIO pin can be read. Edges
+   are timestamped with up to SIM_EDGE_JITTER ns of error, about as much as
+   the noise shifts the comparator's switching. Some
+   waves are exactly the nominal 100Hz, which divides evenly into the 1ms
+   samples, and some are a little off, as the real one is. */
+
+#define SIM_READ 1000 /* ns */
+#define SIM_SCAN_JITTER 50000 /* ns */
+#define SIM_NOISE 0.002
+#define SIM_EDGE_JITTER 10000 /* ns */
+
+static const double SIM_LEVELS[] = { 0.38, 0.52, 0.66 };
+static const double SIM_FREQUENCIES[] = { 100.0, 98.7 };
+
+static struct {
+    int64_t ns, reads, edgePeriod;
+    double period, phase, level;
+    uint32_t edges;
+    bool edgeRising;
+} sim;
+
+static double simRandom( void )
+{
+    return( nextRandom() / 4294967296.0 );
+}
+
+static bool simSample( void )
+{
+    double x = fmod(sim.ns / sim.period + sim.phase,1.0);
+    double wave = x < 0.5 ? 2 * x : 2 - 2 * x;
+    ++sim.reads;
+    return( sim.level + SIM_NOISE * (2 * simRandom() - 1) > wave );
+}
+
+static int64_t simClock( void )
+{
+    return( sim.ns += SIM_READ );
+}
+
+/* The output goes low when the rising wave passes the level, and high when
+   the falling wave does. */
+static bool simEdge( int64_t *time, bool *rising, uint32_t *seqno )
+{
+    for( ;; ) {
+	double x = sim.edgePeriod + (sim.edgeRising ? 1 - sim.level / 2
+						    : sim.level / 2);
+	double ns = (x - sim.phase) * sim.period;
+	if( ns >= sim.ns )
+	    return( false );
+	*rising = sim.edgeRising;
+	if( sim.edgeRising )
+	    ++sim.edgePeriod;
+	sim.edgeRising = !sim.edgeRising;
+	if( ns >= 0 ) {
+	    *time = ns + SIM_EDGE_JITTER * (2 * simRandom() - 1);
+	    *seqno = ++sim.edges;
+	    ++sim.reads;
+	    return( true );
+	}
+    }
+}
+
+/* Run the current estimator on the simulated comparator for some seconds,
+   and print the RMS and worst error of the readings it would have reported
+   (every BATTERY_BURST_INTERVAL ms once ready), in mV, along with how often
+   it woke up, and read the input or was interrupted by an edge. */
+static void simulate( int seconds )
+{
+    InitBattery();
+    sim.reads = sim.edgePeriod = 0;
+    sim.edges = 0;
+    sim.edgeRising = false;
+    sim.phase = simRandom();
+
+    const int64_t END = seconds * 1000000000LL;
+    int64_t wakeUps = 0, reportAt = 0;
+    double sumSquares = 0, worst = 0;
+    int reports = 0;
+    for( int64_t t = 0; t < END; ++wakeUps ) {
+	int delay = GetBatteryReadingDelay();
+	sim.ns = t + (delay > 0 ? 0 : nextRandom() % SIM_SCAN_JITTER);
+	double rAdj, rAct = GetRawBatteryReadings(false,&rAdj);
+	if( BatteryReadingsReady() && t >= reportAt ) {
+	    double error = (rAct - sim.level) * (VOLTAGE_AT_1 - VOLTAGE_AT_0);
+	    sumSquares += error * error;
+	    if( fabs(error) > worst )
+		worst = fabs(error);
+	    ++reports;
+	    reportAt = t + BATTERY_BURST_INTERVAL * 1000000LL;
+	}
+	t += (delay > 0 ? delay : 1) * 1000000LL;
+    }
+
+    printf("%-9s %5.1f Hz  %.2f  %10.1f %10.0f",estimator->name,
+	   1e9 / sim.period,sim.level,(double) wakeUps / seconds,
+	   (double) sim.reads / seconds);
+    if( reports > 0 )
+	printf(" %8.2f %8.2f\n",1000 * sqrt(sumSquares / reports),
+	       1000 * worst);
+    else
+	printf("  never ready\n");
+}
+
+void CompareBatterySampling( int seconds )
+{
+    const struct Estimator *selected = estimator;
+    readSample = simSample;
+    readClock = simClock;
+    readEdge = simEdge;
+
+    printf("estimator wave      level  wake-ups/s    reads/s   rms mV worst mV\n");
+    for( int f = 0; f < sizeof(SIM_FREQUENCIES) / sizeof(double); ++f ) {
+	sim.period = 1e9 / SIM_FREQUENCIES[f];
+	for( int l = 0; l < sizeof(SIM_LEVELS) / sizeof(double); ++l ) {
+	    sim.level = SIM_LEVELS[l];
+	    for( int i = 0; i < NUM_ESTIMATORS; ++i ) {
+		estimator = &ESTIMATORS[i];
+		simulate(seconds);
+	    }
+	}
+    }
+
+    estimator = selected;
+    readSample = GetBatterySample;
+    readClock = NULL;
+    readEdge = ReadBatteryEdge;
+}
+
+/* -------------------------------- Checking -------------------------------- */
+
+/* The boxcar estimator keeps its window as bitsets. It is checked against the
+   original implementation, which kept a byte per sample (1 for a one, or 3
+   for a one with the charger connected), by giving both the same
+   pseudo-random samples and charger states, and comparing every pair of
+   readings bit for bit. The duty cycle and the charger change every
+   CHECK_RUN samples, and the samples cover many trips around the window. */
+
+#define CHECK_SAMPLES (200 * BATTERY_SAMPLES)
+#define CHECK_RUN 5000
+
+static struct {
+    uint8_t samples[BATTERY_SAMPLES];
+    unsigned int nextIndex, total, chargingTotal;
+    bool sample;
+} bytes;
+
+static void bytesInit( void )
+{
+    for( int i = 0; i < BATTERY_SAMPLES; ++i )
+	bytes.samples[i] = i & 1;
+    bytes.nextIndex = 0;
+    bytes.total = BATTERY_SAMPLES / 2;
+    bytes.chargingTotal = 0;
+}
+
+static double bytesReadings( bool sample, bool charging, double *rAdj )
+{
+    bytes.total -= bytes.samples[bytes.nextIndex] & 1;
+    bytes.chargingTotal -= (bytes.samples[bytes.nextIndex] & 2) >> 1;
+    if( sample ) {
+	bytes.samples[bytes.nextIndex] = charging ? 3 : 1;
+	++bytes.total;
+	if( charging ) ++bytes.chargingTotal;
+    }
+    else
+	bytes.samples[bytes.nextIndex] = 0;
+    bytes.nextIndex = (bytes.nextIndex + 1) % BATTERY_SAMPLES;
+
+    double rAct = (double) bytes.total / BATTERY_SAMPLES;
+    double delta = CHARGE_DELTA;
+    if( rAct > KNEE2 )
+	delta *= (FULL - rAct) / (FULL - KNEE2);
+    *rAdj = (bytes.total - delta * bytes.chargingTotal) / BATTERY_SAMPLES;
+    return( rAct );
+}
+
+static bool bytesSample( void )
+{
+    return( bytes.sample );
+}
+
+bool CheckBatteryBitsets( void )
+{
+    const struct Estimator *selected = estimator;
+    estimator = &ESTIMATORS[0];
+    readSample = bytesSample;
+    InitBattery();
+    bytesInit();
+
+    double level = 0.5;
+    bool charging = false;
+    long mismatches = 0;
+    for( long i = 0; i < CHECK_SAMPLES; ++i ) {
+	if( i % CHECK_RUN == 0 ) {
+	    level = 0.3 + 0.5 * simRandom();
+	    charging = nextRandom() & 1;
+	}
+	bytes.sample = simRandom() < level;
+
+	double rAdj, expectedAdj;
+	double rAct = GetRawBatteryReadings(charging,&rAdj);
+	double expected = bytesReadings(bytes.sample,charging,&expectedAdj);
+	if( memcmp(&rAct,&expected,sizeof(double)) != 0
+	 || memcmp(&rAdj,&expectedAdj,sizeof(double)) != 0 ) {
+	    if( mismatches++ == 0 )
+		printf("boxcar sample %ld: %.17g, %.17g instead of "
+		       "%.17g, %.17g\n",i,rAct,rAdj,expected,expectedAdj);
+	}
+    }
+    printf("boxcar bitsets: %ld of %d readings differ from byte per sample\n",
+	   mismatches,CHECK_SAMPLES);
+
+    estimator = selected;
+    readSample = GetBatterySample;
+    InitBattery();
+    return( mismatches == 0 );
+}
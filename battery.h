@@ -20,17 +20,59 @@
 #ifndef __PI_TAB_DAEMON_BATTERY_H__
 #define __PI_TAB_DAEMON_BATTERY_H__
 
-/* Number of binary samples used to compute battery reading. */
+/* Number of binary samples used to compute battery reading. This must be a
+   power of two, and at least 256. */
 #define BATTERY_SAMPLES 16384
 
+/* Average interval in ms between bursts of samples, for the burst estimator. */
+#define BATTERY_BURST_INTERVAL 250
+
+/* Number of edges of the battery monitoring input the GPIO character device
+   should be able to hold, for the edges estimator. */
+#define BATTERY_EDGE_EVENTS 64
+
+/* Select how battery samples are turned into readings: "boxcar" (a running
+   average of BATTERY_SAMPLES samples), "cic" (a moving average of blocks of
+   samples), "adaptive" (an average that converges quickly at first, the
+   default), "burst" (an average of occasional bursts of samples, each
+   covering a whole period of the comparator's waveform), or "edges" (the
+   exact duty cycle over a number of periods, measured from the times of the
+   edges reported by the GPIO character device). Returns false if the name
+   isn't recognized. This must be called before InitBattery. */
+extern bool SetBatteryEstimator( const char *name );
+
+/* Set the number of periods the edges estimator measures the duty cycle over
+   (25 by default, which is about 250ms). Returns false if it isn't at least
+   one. */
+extern bool SetBatteryEdgePeriods( int periods );
+
+/* Return true if the estimator needs the edges of the battery monitoring
+   input (see WatchBatteryEdges). */
+extern bool BatteryNeedsEdges( void );
+
 extern void InitBattery( void );
 
-/* Sample the battery monitoring input, update a circular buffer of samples,
-   and return the average of all the samples (each of which is 0 or 1) in the
-   buffer. Also return a separate sample adjusted for the charger having been
-   connected when the samples were taken. */
+/* Return true once enough samples have been taken for the readings returned
+   by GetRawBatteryReadings to be accurate. */
+extern bool BatteryReadingsReady( void );
+
+/* Sample the battery monitoring input, and return the estimated average of
+   the samples (each of which is 0 or 1). Also return a separate average
+   adjusted for the charger having been connected when the samples were
+   taken. */
 extern double GetRawBatteryReadings( bool charging, double *rAdj );
 
+/* Return how many ms to wait before calling GetRawBatteryReadings again: 0 if
+   it should be called every SCAN_INTERVAL ms, or a randomly dithered interval
+   if the estimator takes its own samples (averaging BATTERY_BURST_INTERVAL ms
+   for bursts). */
+extern int GetBatteryReadingDelay( void );
+
+/* Save or restore the state of the readings, so that a restarted daemon can
+   continue where the previous one left off. */
+extern bool WriteBatteryState( FILE *fp );
+extern bool ReadBatteryState( FILE *fp );
+
 /* Convert a raw battery reading to a voltage. */
 extern double BatteryRawToVoltage( double rAct );
 
@@ -38,4 +80,14 @@ extern double BatteryRawToVoltage( double rAct );
    remaining in the battery. */
 extern double BatteryRawToEnergyRemaining( double rAdj );
 
+/* Run every estimator on simulated comparator waveforms for some (simulated)
+   seconds, and print how accurate its readings were, and how often it woke up
+   and read the input (or was interrupted by one of its edges) to get them. */
+extern void CompareBatterySampling( int seconds );
+
+/* Check that the boxcar estimator's readings are exactly those of the
+   original byte-per-sample implementation, printing the result. Returns
+   false if they differ. */
+extern bool CheckBatteryBitsets( void );
+
 #endif
@@ -0,0 +1,185 @@
+/* PiTabDaemon - Dashboard Control Channel */
+
+/* Copyright (c) 2017 by Stefan Vorkoetter
+
+   This file is part of PiTabDaemon.
+
+   PiTabDaemon is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   PiTabDaemon is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with PiTabDaemon. If not, see <http://www.gnu.org/licenses/>. */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <libgen.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/inotify.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+#include "control.h"
+
+/* The listening socket, the connected clients, and an inotify watch on the
+   directory containing the command file are all in an epoll set of our own,
+   whose descriptor is the one the scheduler waits on, since clients come and
+   go. Sequenced packets preserve message boundaries, so each read returns
+   exactly one command. */
+
+#define MAX_CLIENTS 4
+
+static int clients[MAX_CLIENTS];
+static int numClients = 0, nextClient = 0;
+
+static int epollFd = -1, listenFd = -1, inotifyFd = -1;
+static char commandFile[64];
+
+/* Client and sequence number to acknowledge the last command to. */
+static int replyFd = -1;
+static uint32_t replySeq;
+
+static bool watch( int fd )
+{
+    if( epollFd < 0 && (epollFd = epoll_create1(EPOLL_CLOEXEC)) < 0 )
+	return( false );
+
+    struct epoll_event ev = { .events = EPOLLIN, .data.fd = fd };
+    return( epoll_ctl(epollFd,EPOLL_CTL_ADD,fd,&ev) == 0 );
+}
+
+bool InitControlSocket( const char *path )
+{
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+    if( strlen(path) >= sizeof(addr.sun_path) )
+	return( false );
+    strcpy(addr.sun_path,path);
+
+    /* A previous instance may have left its socket behind. */
+    unlink(path);
+    if( (listenFd = socket(AF_UNIX,SOCK_SEQPACKET | SOCK_NONBLOCK
+				   | SOCK_CLOEXEC,0)) < 0
+     || bind(listenFd,(struct sockaddr *) &addr,sizeof(addr)) < 0
+     || chmod(path,0666) < 0
+     || listen(listenFd,MAX_CLIENTS) < 0
+     || !watch(listenFd) ) {
+	if( listenFd >= 0 )
+	    close(listenFd);
+	listenFd = -1;
+	return( false );
+    }
+    return( true );
+}
+
+bool WatchCommandFile( const char *path )
+{
+    /* The dashboard may rewrite the file in place or replace it, so watch
+       the directory for either. */
+    char dir[sizeof(commandFile)];
+    if( strlen(path) >= sizeof(commandFile) )
+	return( false );
+    strcpy(dir,path);
+    strcpy(commandFile,basename(dir));
+    strcpy(dir,path);
+
+    if( (inotifyFd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC)) < 0
+     || inotify_add_watch(inotifyFd,dirname(dir),
+			  IN_CLOSE_WRITE | IN_MOVED_TO) < 0
+     || !watch(inotifyFd) ) {
+	if( inotifyFd >= 0 )
+	    close(inotifyFd);
+	inotifyFd = -1;
+	return( false );
+    }
+    return( true );
+}
+
+int GetControlFd( void )
+{
+    return( epollFd );
+}
+
+/* Accept any new connections, refusing them if there are too many. */
+static void acceptClients( void )
+{
+    int fd;
+    while( (fd = accept4(listenFd,NULL,NULL,
+			 SOCK_NONBLOCK | SOCK_CLOEXEC)) >= 0 ) {
+	if( numClients < MAX_CLIENTS && watch(fd) )
+	    clients[numClients++] = fd;
+	else
+	    close(fd);
+    }
+}
+
+/* Return true if the command file is among the files that were changed. */
+static bool commandFileChanged( void )
+{
+    char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+    bool changed = false;
+    ssize_t n;
+    while( (n = read(inotifyFd,buf,sizeof(buf))) > 0 ) {
+	for( char *p = buf; p < buf + n; ) {
+	    struct inotify_event *ev = (struct inotify_event *) p;
+	    if( ev->len > 0 && strcmp(ev->name,commandFile) == 0 )
+		changed = true;
+	    p += sizeof(struct inotify_event) + ev->len;
+	}
+    }
+    return( changed );
+}
+
+int ReadCommand( int *value )
+{
+    replyFd = -1;
+    if( inotifyFd >= 0 && commandFileChanged() )
+	return( CONTROL_FILE_CHANGED );
+    if( listenFd >= 0 )
+	acceptClients();
+
+    /* Take commands from each client in turn, closing the connections of
+       clients that have gone away. */
+    while( nextClient < numClients ) {
+	int fd = clients[nextClient];
+	struct ControlCommand cmd = { 0, CONTROL_NONE, 0 };
+	ssize_t n = recv(fd,&cmd,sizeof(cmd),MSG_DONTWAIT);
+	if( n > 0 ) {
+	    replyFd = fd;
+	    replySeq = cmd.seq;
+	    *value = cmd.value;
+	    if( n < sizeof(cmd) || cmd.command == CONTROL_NONE )
+		return( CONTROL_INVALID );
+	    return( cmd.command );
+	}
+	else if( n == 0 || errno != EAGAIN ) {
+	    close(fd);
+	    clients[nextClient] = clients[--numClients];
+	}
+	else
+	    ++nextClient;
+    }
+    nextClient = 0;
+    return( CONTROL_NONE );
+}
+
+void AckCommand( int result )
+{
+    if( replyFd >= 0 ) {
+	struct ControlAck ack = { replySeq, result };
+	send(replyFd,&ack,sizeof(ack),MSG_DONTWAIT | MSG_NOSIGNAL);
+	replyFd = -1;
+    }
+}
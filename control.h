@@ -0,0 +1,70 @@
+/* PiTabDaemon - Dashboard Control Channel */
+
+/* Copyright (c) 2017 by Stefan Vorkoetter
+
+   This file is part of PiTabDaemon.
+
+   PiTabDaemon is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   PiTabDaemon is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with PiTabDaemon. If not, see <http://www.gnu.org/licenses/>. */
+
+#ifndef __PI_TAB_DAEMON_CONTROL_H__
+#define __PI_TAB_DAEMON_CONTROL_H__
+
+#include <stdint.h>
+
+/* The dashboard can send commands to the daemon over a sequenced-packet
+   Unix domain socket, one ControlCommand per packet, and gets back a
+   ControlAck for each one once it has taken effect. The result is 0 on
+   success or an errno value (EINVAL for an unknown command or value).
+   Settings changed this way only persist across reboots if the dashboard
+   also records them in its command file. */
+#define CONTROL_SOCKET "/ram/pitabd.sock"
+
+#define CONTROL_NONE		0
+#define CONTROL_DIM		1	/* Allow dimming when idle (0 or 1). */
+#define CONTROL_USB		2	/* USB/Ethernet/Bluetooth on (0 or 1). */
+#define CONTROL_WIFI		3	/* Wi-Fi on (0 or 1). */
+#define CONTROL_BRIGHTNESS	4	/* Brightness level (0 to 8). */
+
+/* Reported by ReadCommand when the command file has been rewritten, and
+   when a packet isn't a valid command. */
+#define CONTROL_FILE_CHANGED	(-1)
+#define CONTROL_INVALID		(-2)
+
+struct ControlCommand {
+    uint32_t seq;	/* Chosen by the dashboard, echoed in the ack. */
+    int32_t command;
+    int32_t value;
+};
+
+struct ControlAck {
+    uint32_t seq;
+    int32_t result;
+};
+
+/* Listen for connections from the dashboard on the specified socket, and
+   watch for the specified command file being rewritten. */
+extern bool InitControlSocket( const char *path );
+extern bool WatchCommandFile( const char *path );
+
+/* Return a descriptor that becomes readable when there's a command (or a
+   connection, or a change to the command file). */
+extern int GetControlFd( void );
+
+/* Return the next command received, and its value, or CONTROL_NONE if there
+   aren't any more. Each command must be acknowledged with its result before
+   reading the next. */
+extern int ReadCommand( int *value );
+extern void AckCommand( int result );
+
+#endif
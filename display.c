@@ -17,9 +17,18 @@
    You should have received a copy of the GNU General Public License
    along with PiTabDaemon. If not, see <http://www.gnu.org/licenses/>. */
 
+#define _GNU_SOURCE
+
+#include <fcntl.h>
+#include <math.h>
+#include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
+#include <unistd.h>
+#include <sys/stat.h>
 
 #include "display.h"
+#include "replay.h"
 
 /* These levels were chosen to result in a doubling of LED current over a
    range of about 4mA to 500mA, and then tweaking them until the brightness
@@ -30,15 +39,114 @@ static const int DEFAULT_INDEX = 4;
 
 static int nextLevelIndex, currentLevel, targetLevel, rememberLevel;
 
+/* Highest level allowed while saving power, and whether it applies. */
+static const int LIMIT_INDEX = DEFAULT_INDEX;
+static bool limited = false;
+
+/* The backlight brightness file is kept open, and only written when the
+   level actually changes. When it's an ordinary file (for testing), it is
+   truncated after each write so it contains just the latest level. */
+static const char *backlightFile
+    = "/sys/class/backlight/rpi_backlight/brightness";
+static const int MAX_LEVEL = 255;
+static int backlightFd = -1, writtenLevel = -1;
+static bool truncateFile = false;
+
+/* Fades follow a curve of CURVE_SIZE levels whose ratio to each other is
+   constant, from the dimmest visible level to full brightness, so that they
+   appear to change at an even rate. The position on the curve moves at a
+   rate that takes fadeTime ms to go from off to full, and twice as fast
+   when darkening, so that full-on to full-off doesn't take so long. */
+#define CURVE_SIZE 256
+static int curve[CURVE_SIZE];
+static double position;
+static int fadeTime = 1000;
+
+static void initCurve( void )
+{
+    double ratio = (double) MAX_LEVEL / LEVELS[1];
+    curve[0] = 0;
+    for( int i = 1; i < CURVE_SIZE; ++i )
+	curve[i] = (int) (LEVELS[1] * pow(ratio,(i - 1.0) / (CURVE_SIZE - 2))
+			  + 0.5);
+}
+
+/* Return the first position on the curve that is at least as bright as the
+   specified level. */
+static int curvePosition( int level )
+{
+    int lo = 0, hi = CURVE_SIZE - 1;
+    while( lo < hi ) {
+	int mid = (lo + hi) / 2;
+	if( curve[mid] < level )
+	    lo = mid + 1;
+	else
+	    hi = mid;
+    }
+    return( lo );
+}
+
+static void writeBacklight( int level )
+{
+    if( level == writtenLevel )
+	return;
+    if( Replaying() ) {
+	ReplayOutput("backlight %d",level);
+	writtenLevel = level;
+	return;
+    }
+    if( backlightFd < 0 ) {
+	if( (backlightFd = open(backlightFile,O_WRONLY | O_CLOEXEC)) < 0 )
+	    return;
+	struct stat st;
+	truncateFile = fstat(backlightFd,&st) == 0 && S_ISREG(st.st_mode);
+    }
+
+    char buf[16];
+    int n = sprintf(buf,"%d\n",level);
+    if( pwrite(backlightFd,buf,n,0) == n
+     && (!truncateFile || ftruncate(backlightFd,n) == 0) )
+	writtenLevel = level;
+}
+
+/* Return the level the display is heading towards, taking into account any
+   limit. */
+static int limitedTarget( void )
+{
+    if( limited && targetLevel > LEVELS[LIMIT_INDEX] )
+	return( LEVELS[LIMIT_INDEX] );
+    return( targetLevel );
+}
+
+/* Set the file that the backlight level is written to, in place of the
+   Raspberry Pi touchscreen's. */
+void SetBacklightFile( const char *path )
+{
+    if( backlightFd >= 0 ) {
+	close(backlightFd);
+	backlightFd = writtenLevel = -1;
+    }
+    backlightFile = path;
+}
+
+/* Set the time in ms to fade from off to full brightness. */
+void SetFadeTime( int ms )
+{
+    if( ms > 0 )
+	fadeTime = ms;
+}
+
 /* Initialize brightness as specified, or about 1/4 of maximum (about 3/4
    perceptually) by default if specified index is 0 or out of range. */
 void InitBrightness( int initialIndex )
 {
+    initCurve();
     nextLevelIndex = 0 < initialIndex && initialIndex < NUM_LEVELS
     		   ? initialIndex : DEFAULT_INDEX;
     NextBrightness();
-    currentLevel = targetLevel - 1;
-    NudgeBrightness();
+    currentLevel = limitedTarget();
+    position = curvePosition(currentLevel);
+    writeBacklight(currentLevel);
 }
 
 /* Set the target brightness to the next value in the table. */
@@ -56,40 +164,74 @@ void MaxBrightness( void )
     nextLevelIndex = 0;
 }
 
+/* Set the target brightness to the specified value in the table, returning
+   false if there's no such value. */
+bool SetBrightnessIndex( int index )
+{
+    if( index < 0 || index >= NUM_LEVELS )
+	return( false );
+    nextLevelIndex = index;
+    NextBrightness();
+    return( true );
+}
+
 /* Return the current brightness index. */
 int GetBrightnessIndex( void )
 {
     return( (nextLevelIndex + NUM_LEVELS - 1) % NUM_LEVELS );
 }
 
-/* Nudge the display brightness towards the target brightness by 5% of the
-   current brightness. */
-void NudgeBrightness( void )
-{
-    if( currentLevel != targetLevel ) {
-	if( currentLevel == 0 )
-	    currentLevel = LEVELS[1];
-        else if( currentLevel < targetLevel ) {
-	    if( currentLevel < 20 )
-	        ++currentLevel;
-	    else
-		currentLevel = (currentLevel * 21) / 20;
-	    if( currentLevel > targetLevel )
-	        currentLevel = targetLevel;
-	}
-	else {
-	    /* Darken faster than we brighten so that full-on to full-off
-	       doesn't take so long. */
-	    currentLevel = (currentLevel * 10) / 11;
-	    if( currentLevel < targetLevel )
-	        currentLevel = targetLevel;
-	}
-	FILE *fp = fopen("/sys/class/backlight/rpi_backlight/brightness","w");
-	if( fp != NULL ) {
-	    fprintf(fp,"%d\n",currentLevel);
-	    fclose(fp);
-	}
+/* Save and restore the brightness state. The current level is whatever the
+   backlight was last set to, so there's no need to set it again. */
+void GetBrightnessState( struct BrightnessState *state )
+{
+    state->nextLevelIndex = nextLevelIndex;
+    state->currentLevel = currentLevel;
+    state->targetLevel = targetLevel;
+    state->rememberLevel = rememberLevel;
+}
+
+void SetBrightnessState( const struct BrightnessState *state )
+{
+    initCurve();
+    if( 0 <= state->nextLevelIndex && state->nextLevelIndex < NUM_LEVELS ) {
+	nextLevelIndex = state->nextLevelIndex;
+	currentLevel = state->currentLevel;
+	targetLevel = state->targetLevel;
+	rememberLevel = state->rememberLevel;
+	position = curvePosition(currentLevel);
+	writtenLevel = currentLevel;
+    }
+}
+
+/* Move the display brightness along the curve towards the target
+   brightness by as much as it should change in the specified number of ms.
+   Returns true if the target has not been reached yet. */
+bool NudgeBrightness( int elapsed )
+{
+    int target = limitedTarget();
+    if( currentLevel == target )
+	return( false );
+
+    int goal = curvePosition(target);
+    double step = (double) (CURVE_SIZE - 1) * elapsed / fadeTime;
+    if( position < goal ) {
+	if( (position += step) > goal )
+	    position = goal;
     }
+    else if( (position -= 2 * step) < goal )
+	position = goal;
+    currentLevel = position == goal ? target : curve[(int) position];
+
+    writeBacklight(currentLevel);
+    return( currentLevel != target );
+}
+
+/* Limit the brightness to about 1/4 of maximum to save power, or remove the
+   limit. The brightness selected by the user is remembered either way. */
+void LimitBrightness( bool limit )
+{
+    limited = limit;
 }
 
 /* Temporarily dim the display (unless it's already off) to half the current
@@ -23,8 +23,20 @@
 extern void InitBrightness( int initialIndex );
 extern void NextBrightness( void );
 extern void MaxBrightness( void );
-extern void NudgeBrightness( void );
+extern bool NudgeBrightness( int elapsed );
+extern bool SetBrightnessIndex( int index );
 extern int GetBrightnessIndex( void );
+extern void LimitBrightness( bool limit );
+extern void SetBacklightFile( const char *path );
+extern void SetFadeTime( int ms );
+
+/* Brightness state preserved when the daemon is restarted. */
+struct BrightnessState {
+    int nextLevelIndex, currentLevel, targetLevel, rememberLevel;
+};
+
+extern void GetBrightnessState( struct BrightnessState *state );
+extern void SetBrightnessState( const struct BrightnessState *state );
 
 extern void DimDisplay( void );
 extern void DarkenDisplay( void );
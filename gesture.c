@@ -0,0 +1,179 @@
+/* PiTabDaemon - Button Gestures */
+
+/* Copyright (c) 2017 by Stefan Vorkoetter
+
+   This file is part of PiTabDaemon.
+
+   PiTabDaemon is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   PiTabDaemon is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with PiTabDaemon. If not, see <http://www.gnu.org/licenses/>. */
+
+#define _GNU_SOURCE
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "gesture.h"
+#include "sched.h"
+
+/* Each button goes through these states: up; down, until it's been held long
+   enough for a long press or is released; held after a long press; released
+   after a short press, while waiting to see if it will be pressed again; and
+   used up by a double press or chord, until it's released. A button only
+   waits for a second press if it has a double press in the table, and only
+   becomes held if it has a long press (and in either case, if its timing has
+   been set), so buttons without them act as soon as they're released. A chord
+   is made when another button is pressed while buttons that haven't done
+   anything yet are down, and the table has a chord for exactly the buttons
+   now down. */
+
+#define MAX_BUTTONS 32
+
+enum { UP = 0, DOWN, HELD, RELEASED, USED };
+
+static struct {
+    int state;
+    int64_t deadline;
+    int longPress, doublePress;
+} buttons[MAX_BUTTONS];
+
+static const struct Gesture *gestures = NULL;
+static int numGestures = 0;
+
+/* Mask of the buttons that are down. */
+static uint32_t down = 0;
+
+void SetGestures( const struct Gesture *table, int count )
+{
+    gestures = table;
+    numGestures = count;
+}
+
+bool SetGestureTiming( int input, int longPress, int doublePress )
+{
+    if( input < 0 || input >= MAX_BUTTONS || longPress <= 0
+     || doublePress <= 0 )
+	return( false );
+    buttons[input].longPress = longPress;
+    buttons[input].doublePress = doublePress;
+    return( true );
+}
+
+/* Find the gesture in the table for the specified buttons. */
+static const struct Gesture *findGesture( int gesture, uint32_t mask )
+{
+    for( int i = 0; i < numGestures; ++i )
+	if( gestures[i].gesture == gesture && gestures[i].buttons == mask )
+	    return( &gestures[i] );
+    return( NULL );
+}
+
+/* Run the action for a gesture, if the table has one. */
+static void act( int gesture, uint32_t mask )
+{
+    const struct Gesture *g = findGesture(gesture,mask);
+    if( g != NULL )
+	g->action();
+}
+
+/* Return the earliest deadline of any button. */
+static int64_t nextDeadline( void )
+{
+    int64_t deadline = NEVER;
+    for( int i = 0; i < MAX_BUTTONS; ++i )
+	if( buttons[i].state != UP && buttons[i].deadline < deadline )
+	    deadline = buttons[i].deadline;
+    return( deadline );
+}
+
+static void press( int input, int64_t now )
+{
+    uint32_t bit = 1U << input;
+    down |= bit;
+
+    /* Chords are only made by buttons that haven't done anything else. */
+    bool fresh = true;
+    for( int i = 0; i < MAX_BUTTONS; ++i )
+	if( (down & ~bit) >> i & 1 && buttons[i].state != DOWN )
+	    fresh = false;
+    if( fresh && (down & ~bit) != 0 && findGesture(GESTURE_CHORD,down) ) {
+	for( int i = 0; i < MAX_BUTTONS; ++i ) {
+	    if( down >> i & 1 ) {
+		buttons[i].state = USED;
+		buttons[i].deadline = NEVER;
+	    }
+	}
+	act(GESTURE_CHORD,down);
+	return;
+    }
+
+    if( buttons[input].state == RELEASED ) {
+	buttons[input].state = USED;
+	buttons[input].deadline = NEVER;
+	act(GESTURE_DOUBLE_PRESS,bit);
+    }
+    else {
+	int longPress = buttons[input].longPress;
+	buttons[input].state = DOWN;
+	buttons[input].deadline =
+	    longPress > 0 && findGesture(GESTURE_LONG_PRESS,bit) != NULL
+	    ? now + longPress : NEVER;
+    }
+}
+
+static void release( int input, int64_t now )
+{
+    uint32_t bit = 1U << input;
+    down &= ~bit;
+
+    if( buttons[input].state == DOWN ) {
+	int doublePress = buttons[input].doublePress;
+	if( doublePress > 0
+	 && findGesture(GESTURE_DOUBLE_PRESS,bit) != NULL ) {
+	    buttons[input].state = RELEASED;
+	    buttons[input].deadline = now + doublePress;
+	    return;
+	}
+	act(GESTURE_PRESS,bit);
+    }
+    buttons[input].state = UP;
+}
+
+int64_t GestureInput( int input, bool pressed, int64_t now )
+{
+    if( input >= 0 && input < MAX_BUTTONS ) {
+	if( pressed )
+	    press(input,now);
+	else
+	    release(input,now);
+    }
+    return( nextDeadline() );
+}
+
+int64_t CheckGestures( int64_t now )
+{
+    for( int i = 0; i < MAX_BUTTONS; ++i ) {
+	if( buttons[i].state == UP || buttons[i].deadline > now )
+	    continue;
+	if( buttons[i].state == DOWN ) {
+	    buttons[i].state = HELD;
+	    buttons[i].deadline = NEVER;
+	    act(GESTURE_LONG_PRESS,1U << i);
+	}
+	else if( buttons[i].state == RELEASED ) {
+	    buttons[i].state = UP;
+	    act(GESTURE_PRESS,1U << i);
+	}
+    }
+    return( nextDeadline() );
+}
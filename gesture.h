@@ -0,0 +1,54 @@
+/* PiTabDaemon - Button Gestures */
+
+/* Copyright (c) 2017 by Stefan Vorkoetter
+
+   This file is part of PiTabDaemon.
+
+   PiTabDaemon is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   PiTabDaemon is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with PiTabDaemon. If not, see <http://www.gnu.org/licenses/>. */
+
+#ifndef __PI_TAB_DAEMON_GESTURE_H__
+#define __PI_TAB_DAEMON_GESTURE_H__
+
+/* Gestures that can be made with the buttons: a short press (once it's
+   released, and any chance of it becoming a double press has passed), a
+   long press (as soon as the button has been held long enough), a double
+   press (as soon as the button is pressed again), and a chord (as soon as
+   all of its buttons are down together). */
+enum { GESTURE_PRESS, GESTURE_LONG_PRESS, GESTURE_DOUBLE_PRESS, GESTURE_CHORD };
+
+/* What to do when a gesture is made on a button, or on a set of buttons for
+   a chord. Buttons are given as a mask of input numbers (see io.h). */
+struct Gesture {
+    int gesture;
+    uint32_t buttons;
+    void (*action)( void );
+};
+
+/* Set the table of gestures to recognize, which must remain valid. */
+extern void SetGestures( const struct Gesture *gestures, int count );
+
+/* Set how long in ms a button must be held to make a long press, and how
+   soon after being released it must be pressed again to make a double
+   press. Until this is done, a button makes neither. Returns false if the
+   input number is out of range or either time isn't positive. */
+extern bool SetGestureTiming( int input, int longPress, int doublePress );
+
+/* Pass on a button being pressed or released, or check whether a button has
+   now been held long enough, or waited on long enough, to make a gesture.
+   Actions for any gestures made are run. Both return the time at which
+   CheckGestures should be called next, or NEVER. */
+extern int64_t GestureInput( int input, bool pressed, int64_t now );
+extern int64_t CheckGestures( int64_t now );
+
+#endif
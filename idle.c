@@ -17,45 +17,172 @@
    You should have received a copy of the GNU General Public License
    along with PiTabDaemon. If not, see <http://www.gnu.org/licenses/>. */
 
-#include <stdio.h>
-#include <time.h>
-#include <sys/types.h>
-#include <sys/stat.h>
-#include <unistd.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
 #include <X11/Xlib.h>
-#include <X11/extensions/scrnsaver.h>
+#include <X11/extensions/dpms.h>
+#include <X11/extensions/sync.h>
 
-/* Return user idle time in milliseconds. */
+#include "activity.h"
+#include "idle.h"
+#include "replay.h"
+#include "sched.h"
+#include "x11.h"
+
+/* The X server's idle time is its SYNC extension's IDLETIME counter. Rather
+   than asking for the counter's value over and over, the daemon sets alarms
+   on it, which the server reports as events on the X connection when the
+   idle time crosses the point at which the display should be dimmed or
+   turned off, or drops back below that point because the user did
+   something. Transition alarms stay armed after firing, so they only have
+   to be set up once. */
+
+static Display *display = NULL;
+static int syncEventBase;
+static XSyncCounter idleCounter = None;
+static XSyncAlarm dimAlarm = None, darkAlarm = None, activeAlarm = None;
+
+/* Whether the X server's DPMS settings have been taken over, and what they
+   were before that. */
+static bool dpmsReady = false;
+static BOOL dpmsWasEnabled;
+static CARD16 dpmsStandby, dpmsSuspend, dpmsOff;
+
+/* Look up the IDLETIME counter, if the X server is running. */
+static bool findIdleCounter( void )
+{
+    if( idleCounter != None )
+	return( true );
+
+    int errorBase, major, minor, n;
+    if( (display = GetX11Display()) == NULL
+     || !XSyncQueryExtension(display,&syncEventBase,&errorBase)
+     || !XSyncInitialize(display,&major,&minor) )
+	return( false );
+
+    XSyncSystemCounter *counters = XSyncListSystemCounters(display,&n);
+    for( int i = 0; i < n; ++i )
+	if( strcmp(counters[i].name,"IDLETIME") == 0 )
+	    idleCounter = counters[i].counter;
+    if( counters != NULL )
+	XSyncFreeSystemCounterList(counters);
+    return( idleCounter != None );
+}
+
+/* Create or change an alarm that goes off when the idle time crosses the
+   given value in the given direction. */
+static XSyncAlarm setAlarm( XSyncAlarm alarm, int ms, XSyncTestType test )
+{
+    XSyncAlarmAttributes attr;
+    unsigned long flags = XSyncCACounter | XSyncCAValueType | XSyncCATestType
+			| XSyncCAValue | XSyncCADelta | XSyncCAEvents;
+    attr.trigger.counter = idleCounter;
+    attr.trigger.value_type = XSyncAbsolute;
+    attr.trigger.test_type = test;
+    XSyncIntToValue(&attr.trigger.wait_value,ms);
+    XSyncIntToValue(&attr.delta,0);
+    attr.events = True;
+
+    if( alarm == None )
+	return( XSyncCreateAlarm(display,flags,&attr) );
+    XSyncChangeAlarm(display,alarm,flags,&attr);
+    return( alarm );
+}
+
+bool InitIdleAlarms( int toDim, int toDark )
+{
+    if( !findIdleCounter() )
+	return( false );
+
+    dimAlarm = setAlarm(dimAlarm,toDim,XSyncPositiveTransition);
+    darkAlarm = setAlarm(darkAlarm,toDark,XSyncPositiveTransition);
+    activeAlarm = setAlarm(activeAlarm,toDim - 1,XSyncNegativeTransition);
+    XFlush(display);
+    return( true );
+}
+
+int GetIdleFd( void )
+{
+    return( display != NULL ? ConnectionNumber(display) : -1 );
+}
+
+/* Handle any events from the X server, including ones already read from
+   the connection while waiting for replies to other requests. */
+bool ReadIdleEvents( void )
+{
+    bool alarm = false;
+    if( display == NULL )
+	return( false );
+
+    while( XPending(display) > 0 ) {
+	XEvent ev;
+	XNextEvent(display,&ev);
+	if( ev.type == syncEventBase + XSyncAlarmNotify )
+	    alarm = true;
+    }
+    return( alarm );
+}
+
+/* Return user idle time in milliseconds, which is the shorter of the X
+   server's idle time and the time since the last activity on any input
+   device (which includes use of the console), or -1 if neither is known. */
 int IdleTime( void )
 {
-    /* Check X11 idle time. Based on code found at
-       https://superuser.com/questions/638357 */
-    static Display *display = NULL;
-    int event_base, error_base, idle;
-    XScreenSaverInfo info;
-
-    if( display == NULL && (display = XOpenDisplay(":0.0")) == NULL )
-        return( -1 );
-
-    if( !XScreenSaverQueryExtension(display,&event_base,&error_base) )
-	return( -2 );
-
-    XScreenSaverQueryInfo(display,DefaultRootWindow(display),&info);
-    idle = info.idle;
-
-    /* Check console idle time. */
-    time_t now = time(NULL);
-    char tty[10];
-    struct stat st;
-
-    for( int i = 1; i <= 6 && idle > 0; ++i ) {
-	sprintf(tty,"/dev/tty%1.1d",i);
-	if( stat(tty,&st) == 0 ) {
-	    int ms = (now - st.st_mtime) * 1000;
-	    if( ms < idle )
-		idle = ms;
-	}
+    int idle = -1;
+    XSyncValue value;
+
+    if( findIdleCounter() && XSyncQueryCounter(display,idleCounter,&value) )
+	idle = XSyncValueLow32(value);
+
+    int64_t last = LastActivity();
+    if( last >= 0 ) {
+	int ms = NowMs() - last;
+	if( idle < 0 || ms < idle )
+	    idle = ms;
     }
 
     return( idle );
 }
+
+/* The daemon does its own dimming, so the X server's DPMS timeouts are
+   turned off, but DPMS itself is left enabled. Forcing the display off
+   requires it, and it lets the server turn the display back on by itself as
+   soon as it sees input, without waiting for the daemon. */
+bool SetDisplayPower( bool on )
+{
+    if( Replaying() ) {
+	ReplayOutput("display power %s",on ? "on" : "off");
+	return( true );
+    }
+
+    int eventBase, errorBase;
+    Display *d = GetX11Display();
+    if( d == NULL || !DPMSQueryExtension(d,&eventBase,&errorBase)
+     || !DPMSCapable(d) )
+	return( false );
+
+    if( !dpmsReady ) {
+	CARD16 level;
+	DPMSGetTimeouts(d,&dpmsStandby,&dpmsSuspend,&dpmsOff);
+	DPMSInfo(d,&level,&dpmsWasEnabled);
+	DPMSSetTimeouts(d,0,0,0);
+	DPMSEnable(d);
+	dpmsReady = true;
+    }
+    DPMSForceLevel(d,on ? DPMSModeOn : DPMSModeOff);
+    XFlush(d);
+    return( true );
+}
+
+void RestoreDisplayPower( void )
+{
+    Display *d;
+    if( !dpmsReady || (d = GetX11Display()) == NULL )
+	return;
+    DPMSSetTimeouts(d,dpmsStandby,dpmsSuspend,dpmsOff);
+    if( !dpmsWasEnabled )
+	DPMSDisable(d);
+    XFlush(d);
+    dpmsReady = false;
+}
@@ -22,4 +22,24 @@
 
 extern int IdleTime( void );
 
+/* Set (or change) alarms that go off when the X server has been idle for the
+   specified times in ms, and when it stops being idle after the first. This
+   fails if the X server isn't running (yet). */
+extern bool InitIdleAlarms( int toDim, int toDark );
+
+/* Return the X connection's descriptor, which becomes readable when an alarm
+   goes off, and handle whatever arrived, returning true if it included an
+   alarm. */
+extern int GetIdleFd( void );
+extern bool ReadIdleEvents( void );
+
+/* Turn the display itself (not just the backlight) off or back on using the
+   X server's DPMS extension. This fails if the X server isn't running (yet)
+   or the display doesn't support it. */
+extern bool SetDisplayPower( bool on );
+
+/* Give the X server back the DPMS settings it had before the display was
+   first turned off or on, if it was. */
+extern void RestoreDisplayPower( void );
+
 #endif
@@ -17,24 +17,40 @@
    You should have received a copy of the GNU General Public License
    along with PiTabDaemon. If not, see <http://www.gnu.org/licenses/>. */
 
+#define _GNU_SOURCE
+
+#include <fcntl.h>
 #include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
 #include <bcm2835.h>
 #include <math.h>
+#include <sys/ioctl.h>
+#include <linux/gpio.h>
 
 #include "battery.h"
 #include "io.h"
+#include "recorder.h"
+#include "replay.h"
 
 /* Debounced Inputs
 
    The ports for monitoring the power switch, user buttons, and status from the
    PowerBoost 1000C are all treated as buttons, and are debounced to avoid
-   spurious triggering of actions. The debouncing is accomplished by shifting
-   the (possibly inverted) raw state of an input into the low order bit of a
-   word, and when enough consecutive ones are seen, the input becomes active.
-   Likewise, when same number of consecutive zeroes are seen, the input becomes
-   inactive. The degree of debouncing can be specified separately for each
-   input. Since the inputs are scanned by the main program about once per
-   millisecond, each bit in the mask corresponds to 1ms of debouncing. */
+   spurious triggering of actions. An input becomes active when enough
+   consecutive scans have seen it (possibly inverted) as one, and inactive when
+   the same number of consecutive scans have seen it as zero. The degree of
+   debouncing can be specified separately for each input. Since the inputs are
+   scanned by the main program about once per millisecond, each bit in the
+   mask corresponds to 1ms of debouncing.
+
+   All the inputs are in the first bank of GPIO pins, so a scan reads the
+   level register for that bank once and debounces every input at the same
+   time. The history of the last 32 scans is kept transposed, one word per
+   scan with one bit per pin, so that ANDing the most recent words together
+   finds the pins that have been steadily one (or zero) for that many scans,
+   regardless of how many inputs there are. */
 
 #define NUM_INPUTS 7
 
@@ -54,15 +70,55 @@ const static struct PinInfo PIN_INFO[NUM_INPUTS] = {
     { RPI_BPLUS_GPIO_J8_29, 1, 0x0000000F }	/* Charge Completed */
 };
 
-/* The scan map records the actual state of each input over the last 32 scans,
-   and the logical state of each input after debouncing. */
+#define MAX_DEBOUNCE 32
 
-struct ScanMap {
-    uint32_t raw;
-    bool debounced;
-};
+/* Pin level history, indexed by scan number modulo MAX_DEBOUNCE, and for each
+   depth, the pins debounced over that many scans (minus one). All of these
+   are masks of GPIO pin numbers. */
+static uint32_t history[MAX_DEBOUNCE];
+static unsigned int historyIndex;
+static uint32_t depthMask[MAX_DEBOUNCE];
+static int maxDepth;
+static uint32_t pinMask, invertMask, debouncedPins;
+
+/* Masks of input numbers: the state of each input after debouncing, and the
+   inputs that changed in the most recent scan (or events since then) that
+   haven't yet been returned by GetInput. */
+static uint32_t debounced, changed;
+
+/* GPIO Character Device
+
+   As an alternative to scanning the BCM2835 registers, the inputs can be
+   requested from the kernel's GPIO character device (for example
+   /dev/gpiochip0, or a gpio-sim chip for testing), with edge detection and
+   the kernel doing the debouncing. Each debounced change then arrives as an
+   event on a file descriptor that can be waited on, so nothing needs to be
+   scanned. The debounce period of each input is the number of ones in its
+   debounceMask, in milliseconds, as with scanning. The GPIO logical pin
+   numbers are the line offsets on the Raspberry Pi's main GPIO chip. */
+
+#define CONSUMER "pitabd"
+
+static int inputFd = -1, batteryFd = -1;
+
+/* Edges of the battery monitoring input read from the kernel but not yet
+   returned by ReadBatteryEdge. They are read in batches, since there are
+   about 200 a second. */
+#define EDGE_BATCH 16
+
+static struct gpio_v2_line_event edgeEvents[EDGE_BATCH];
+static int edgeIndex, edgeCount;
+
+/* Input changes read from events but not yet returned by GetAllInputs. */
+static uint32_t pendingChanges;
+
+/* Trace Replay
 
-static struct ScanMap scanMap[NUM_INPUTS];
+   When a trace is being replayed (see replay.h), the levels of the pins are
+   taken from the trace instead of the level register, but are otherwise
+   scanned and debounced in the same way. */
+
+static bool replaying = false;
 
 /* Battery Monitoring Input */
 
@@ -76,31 +132,229 @@ static void initPort( uint8_t pin )
     bcm2835_gpio_set_pud(pin,BCM2835_GPIO_PUD_UP);
 }
 
+/* Set up the masks used to debounce the scanned inputs. */
+static bool initDebouncing( void )
+{
+    pinMask = invertMask = debouncedPins = 0;
+    maxDepth = 0;
+    for( int i = 0; i < MAX_DEBOUNCE; ++i )
+	history[i] = depthMask[i] = 0;
+    for( int i = 0; i < NUM_INPUTS; ++i ) {
+	const struct PinInfo *input = &PIN_INFO[i];
+	if( input->gpioPin >= 32 )
+	    return( false );
+
+	uint32_t pin = 1U << input->gpioPin;
+	int depth = __builtin_popcount(input->debounceMask);
+	pinMask |= pin;
+	if( input->invertBit )
+	    invertMask |= pin;
+	depthMask[depth-1] |= pin;
+	if( depth > maxDepth )
+	    maxDepth = depth;
+    }
+    debounced = changed = 0;
+    return( true );
+}
+
 bool InitGPIO( void )
 {
     /* Initialize BCM2835 GPIO library. */
     bcm2835_set_debug(0);
-    if( !bcm2835_init() )
+    if( !bcm2835_init() || !initDebouncing() )
         return( false );
 
-    /* Initialize debounced inputs. */
-    for( int i = 0; i < NUM_INPUTS; ++i ) {
+    /* Initialize debounced inputs and battery monitoring port. */
+    for( int i = 0; i < NUM_INPUTS; ++i )
 	initPort(PIN_INFO[i].gpioPin);
-        scanMap[i].raw = 0x00000000;
-	scanMap[i].debounced = false;
+    initPort(GPIO_BATT_MON);
+
+    return( true );
+}
+
+bool InitGPIOReplay( void )
+{
+    replaying = true;
+    return( initDebouncing() );
+}
+
+static int requestLines( int chipFd, struct gpio_v2_line_request *req )
+{
+    strcpy(req->consumer,CONSUMER);
+    if( ioctl(chipFd,GPIO_V2_GET_LINE_IOCTL,req) < 0 )
+        return( -1 );
+    return( req->fd );
+}
+
+bool InitGPIOChip( const char *path )
+{
+    int chipFd = open(path,O_RDONLY | O_CLOEXEC);
+    if( chipFd < 0 )
+        return( false );
+
+    /* Request all the debounced inputs, with pull-ups as above, generating
+       events on both edges. Active-low inputs are inverted by the kernel, so
+       rising edges are always transitions to active. */
+    struct gpio_v2_line_request req;
+    memset(&req,0,sizeof(req));
+    req.num_lines = NUM_INPUTS;
+    req.config.flags = GPIO_V2_LINE_FLAG_INPUT | GPIO_V2_LINE_FLAG_BIAS_PULL_UP
+		     | GPIO_V2_LINE_FLAG_EDGE_RISING
+		     | GPIO_V2_LINE_FLAG_EDGE_FALLING;
+
+    struct gpio_v2_line_config_attribute *invert = &req.config.attrs[0];
+    invert->attr.id = GPIO_V2_LINE_ATTR_ID_FLAGS;
+    invert->attr.flags = req.config.flags | GPIO_V2_LINE_FLAG_ACTIVE_LOW;
+    req.config.num_attrs = 1;
+
+    for( int i = 0; i < NUM_INPUTS; ++i ) {
+	const struct PinInfo *input = &PIN_INFO[i];
+	req.offsets[i] = input->gpioPin;
+	if( input->invertBit )
+	    invert->mask |= 1ULL << i;
+
+	/* Inputs with the same debounce period share an attribute. */
+	uint32_t us = __builtin_popcount(input->debounceMask) * 1000;
+	int a = 1;
+	while( a < req.config.num_attrs
+	    && req.config.attrs[a].attr.debounce_period_us != us )
+	    ++a;
+	if( a == req.config.num_attrs ) {
+	    if( a == GPIO_V2_LINE_NUM_ATTRS_MAX ) {
+		close(chipFd);
+		return( false );
+	    }
+	    req.config.attrs[a].attr.id = GPIO_V2_LINE_ATTR_ID_DEBOUNCE;
+	    req.config.attrs[a].attr.debounce_period_us = us;
+	    ++req.config.num_attrs;
+	}
+	req.config.attrs[a].mask |= 1ULL << i;
     }
+    inputFd = requestLines(chipFd,&req);
+
+    /* Request the battery monitoring input, which is sampled, not debounced,
+       with room for its edges in case they are watched. */
+    memset(&req,0,sizeof(req));
+    req.num_lines = 1;
+    req.offsets[0] = GPIO_BATT_MON;
+    req.config.flags = GPIO_V2_LINE_FLAG_INPUT | GPIO_V2_LINE_FLAG_BIAS_PULL_UP;
+    req.event_buffer_size = BATTERY_EDGE_EVENTS;
+    batteryFd = requestLines(chipFd,&req);
+
+    close(chipFd);
+    if( inputFd < 0 || batteryFd < 0
+     || fcntl(inputFd,F_SETFL,fcntl(inputFd,F_GETFL) | O_NONBLOCK) < 0 )
+        return( false );
 
-    /* Initialize battery monitoring port. */
-    initPort(GPIO_BATT_MON);
+    /* Inputs that are already active report becoming active on the first
+       call to GetInput, just as they would after debouncing when scanning. */
+    struct gpio_v2_line_values values = { 0, (1ULL << NUM_INPUTS) - 1 };
+    if( ioctl(inputFd,GPIO_V2_LINE_GET_VALUES_IOCTL,&values) < 0 )
+        return( false );
+    debounced = changed = 0;
+    pendingChanges = values.bits;
 
     return( true );
 }
 
 /* ---------------------------- Debounced Input ----------------------------- */
 
-/* Read the specified input (0..NUM_INPUTS-1) and debounce it, returning 1
-   if it just became active, -1 if it just became inactive, or 0 if nothing has
-   changed. */
+/* Return a file descriptor that becomes readable when an input changes, or
+   -1 if the inputs are not event driven and must be scanned instead. */
+
+int GetInputFd( void )
+{
+    return( inputFd );
+}
+
+/* Read one input change event, if any, so that it will be returned by the
+   next call to GetAllInputs. Returns false if there are no more events.
+   Events are read one at a time so that a press and release can't be merged
+   into nothing before GetAllInputs sees them. */
+
+bool ReadInputEvent( void )
+{
+    struct gpio_v2_line_event event;
+    if( read(inputFd,&event,sizeof(event)) != sizeof(event) )
+        return( false );
+
+    for( int i = 0; i < NUM_INPUTS; ++i ) {
+	if( PIN_INFO[i].gpioPin == event.offset ) {
+	    uint32_t bit = 1U << i;
+	    bool active = event.id == GPIO_V2_LINE_EVENT_RISING_EDGE;
+	    if( active != ((debounced ^ pendingChanges) >> i & 1) )
+		pendingChanges ^= bit;
+	}
+    }
+    return( true );
+}
+
+/* Scan all the inputs and debounce them, returning a mask of the inputs that
+   just changed (bit i for input i), and setting *state to a mask of the inputs
+   that are now active. */
+
+uint32_t GetAllInputs( uint32_t *state )
+{
+    /* If the kernel is debouncing the inputs, just return the changes from
+       the events read since the last call. */
+    if( inputFd >= 0 ) {
+	changed = pendingChanges;
+	pendingChanges = 0;
+	debounced ^= changed;
+	*state = debounced;
+	return( changed );
+    }
+
+    /* Read the level of every pin in the bank and record the (possibly
+       inverted) values of the input pins in the history. */
+    historyIndex = (historyIndex + 1) % MAX_DEBOUNCE;
+    if( replaying ) {
+	uint32_t inputs = GetTraceInputs(), levels = 0;
+	for( int i = 0; i < NUM_INPUTS; ++i )
+	    if( inputs >> i & 1 )
+		levels |= 1U << PIN_INFO[i].gpioPin;
+	history[historyIndex] = levels;
+    }
+    else
+	history[historyIndex] = (bcm2835_peri_read(bcm2835_gpio + BCM2835_GPLEV0/4)
+				 ^ invertMask) & pinMask;
+
+    /* Working back through the history, find the pins that have been one or
+       zero for as many scans as they need to be debounced over. */
+    uint32_t allOnes = pinMask, allZeroes = pinMask;
+    uint32_t steadyOnes = 0, steadyZeroes = 0;
+    for( int depth = 0; depth < maxDepth; ++depth ) {
+	uint32_t levels = history[(historyIndex - depth) % MAX_DEBOUNCE];
+	allOnes &= levels;
+	allZeroes &= ~levels;
+	steadyOnes |= allOnes & depthMask[depth];
+	steadyZeroes |= allZeroes & depthMask[depth];
+    }
+
+    /* Inputs that have been steady long enough in the opposite state to
+       their debounced state have changed. */
+    uint32_t changedPins = steadyOnes & ~debouncedPins
+			 | steadyZeroes & debouncedPins;
+    debouncedPins ^= changedPins;
+
+    /* Translate the changes to input numbers. This only has to be done when
+       something changed, which is rare. */
+    changed = 0;
+    if( changedPins != 0 ) {
+	for( int i = 0; i < NUM_INPUTS; ++i )
+	    if( changedPins >> PIN_INFO[i].gpioPin & 1 )
+		changed |= 1U << i;
+	debounced ^= changed;
+    }
+
+    *state = debounced;
+    return( changed );
+}
+
+/* Return the change in the specified input (0..NUM_INPUTS-1) found by the
+   most recent call to GetAllInputs: 1 if it just became active, -1 if it just
+   became inactive, or 0 if nothing has changed. Each change is only returned
+   once. */
 
 int GetInput( int inputNum )
 {
@@ -108,37 +362,86 @@ int GetInput( int inputNum )
     if( inputNum < 0 || inputNum >= NUM_INPUTS )
         return( 0 );
 
-    struct ScanMap *state = &scanMap[inputNum];
-    const struct PinInfo *input = &PIN_INFO[inputNum];
-
-    /* Read the input pin and shift its value (possibly inverted) into the raw
-       buffer for this pin. */
-    state->raw = (state->raw << 1)
-	       | (bcm2835_gpio_lev(input->gpioPin) ^ input->invertBit);
-
-    /* If the input has been active (e.g. button press) for long enough (and
-       wasn't already), record that it became active and return 1. */
-    if( !state->debounced
-     && (state->raw & input->debounceMask) == input->debounceMask )
-    {
-	state->debounced = true;
-	return( 1 );
-    }
+    uint32_t bit = 1U << inputNum;
+    if( !(changed & bit) )
+	return( 0 );
+    changed &= ~bit;
+    int c = debounced & bit ? 1 : -1;
+    Record(REC_INPUT,inputNum,c,0);
+    return( c );
+}
 
-    /* If the input has been inactive (e.g. button release) for long enough
-       (and wasn't already), record that it became inactive and return -1. */
-    if( state->debounced && (state->raw & input->debounceMask) == 0 ) {
-	state->debounced = false;
-        return( -1 );
-    }
+/* Save and restore the debouncing state, so that inputs that were already
+   active don't appear to become active again after a restart. If the kernel
+   is debouncing, the changes still to be reported become those relative to
+   the restored state. */
+
+void GetInputState( struct InputState *state )
+{
+    for( int i = 0; i < MAX_DEBOUNCE; ++i )
+	state->history[i] = history[i];
+    state->historyIndex = historyIndex;
+    state->debouncedPins = debouncedPins;
+    state->debounced = debounced;
+}
 
-    /* Nothing changed. */
-    return( 0 );
+void SetInputState( const struct InputState *state )
+{
+    for( int i = 0; i < MAX_DEBOUNCE; ++i )
+	history[i] = state->history[i];
+    historyIndex = state->historyIndex % MAX_DEBOUNCE;
+    debouncedPins = state->debouncedPins & pinMask;
+    if( inputFd >= 0 )
+	pendingChanges ^= state->debounced ^ debounced;
+    debounced = state->debounced;
+    changed = 0;
 }
 
 /* --------------------------- Battery Monitoring --------------------------- */
 
 bool GetBatterySample( void )
 {
+    if( replaying )
+	return( GetTraceBatterySample() );
+    if( batteryFd >= 0 ) {
+	struct gpio_v2_line_values values = { 0, 1 };
+	ioctl(batteryFd,GPIO_V2_LINE_GET_VALUES_IOCTL,&values);
+	return( values.bits & 1 );
+    }
     return( bcm2835_gpio_lev(GPIO_BATT_MON) != 0 );
 }
+
+/* Reconfigure the battery monitoring input to generate events on both edges,
+   timestamped with the monotonic clock (the default). */
+bool WatchBatteryEdges( void )
+{
+    if( batteryFd < 0 )
+        return( false );
+
+    struct gpio_v2_line_config config;
+    memset(&config,0,sizeof(config));
+    config.flags = GPIO_V2_LINE_FLAG_INPUT | GPIO_V2_LINE_FLAG_BIAS_PULL_UP
+		 | GPIO_V2_LINE_FLAG_EDGE_RISING
+		 | GPIO_V2_LINE_FLAG_EDGE_FALLING;
+    return( ioctl(batteryFd,GPIO_V2_LINE_SET_CONFIG_IOCTL,&config) == 0
+	 && fcntl(batteryFd,F_SETFL,fcntl(batteryFd,F_GETFL) | O_NONBLOCK)
+	    == 0 );
+}
+
+bool ReadBatteryEdge( int64_t *time, bool *rising, uint32_t *seqno )
+{
+    if( edgeIndex == edgeCount ) {
+	ssize_t size = batteryFd >= 0 ? read(batteryFd,edgeEvents,
+					     sizeof(edgeEvents)) : -1;
+	if( size < (ssize_t) sizeof(edgeEvents[0]) )
+	    return( false );
+	edgeIndex = 0;
+	edgeCount = size / sizeof(edgeEvents[0]);
+    }
+
+    const struct gpio_v2_line_event *event = &edgeEvents[edgeIndex++];
+    *time = event->timestamp_ns;
+    *rising = event->id == GPIO_V2_LINE_EVENT_RISING_EDGE;
+    *seqno = event->line_seqno;
+    return( true );
+}
@@ -20,7 +20,8 @@
 #ifndef __PI_TAB_DAEMON_IO_H__
 #define __PI_TAB_DAEMON_IO_H__
 
-/* Inputs that can be checked by GetInput. */
+/* Inputs that can be checked by GetInput, and their bit numbers in the masks
+   returned by GetAllInputs. */
 #define SWITCH_ON 0
 #define BUTTON_1  1
 #define BUTTON_2  2
@@ -30,8 +31,34 @@
 #define CHARGED   6
 
 extern bool InitGPIO( void );
+extern uint32_t GetAllInputs( uint32_t *state );
 extern int GetInput( int inputNum );
 
+/* Use the GPIO character device at the specified path instead of the BCM2835
+   registers. Input changes are then read as events rather than scanned. */
+extern bool InitGPIOChip( const char *path );
+extern int GetInputFd( void );
+extern bool ReadInputEvent( void );
+
+/* Take the inputs from the trace being replayed (see replay.h) instead. */
+extern bool InitGPIOReplay( void );
+
+/* Debouncing state preserved when the daemon is restarted. */
+struct InputState {
+    uint32_t history[32];
+    uint32_t historyIndex, debouncedPins, debounced;
+};
+
+extern void GetInputState( struct InputState *state );
+extern void SetInputState( const struct InputState *state );
+
 extern bool GetBatterySample( void );
 
+/* When using the GPIO character device, have it report the rising and falling
+   edges of the battery monitoring input, and read them one at a time, with
+   the time of each (in ns on the monotonic clock) and its sequence number,
+   returning false when there are no more. */
+extern bool WatchBatteryEdges( void );
+extern bool ReadBatteryEdge( int64_t *time, bool *rising, uint32_t *seqno );
+
 #endif
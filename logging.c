@@ -17,53 +17,297 @@
    You should have received a copy of the GNU General Public License
    along with PiTabDaemon. If not, see <http://www.gnu.org/licenses/>. */
 
+#define _GNU_SOURCE
+
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
+#include <string.h>
 #include <time.h>
 #include <unistd.h>
+#include <linux/futex.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
 
 #include "logging.h"
+#include "replay.h"
 
 #define LOG_FILE "/var/log/pitabd.log"
 
-void WriteToLog( const char *msg )
+/* Size in bytes at which the log file is rotated. */
+#define LOG_MAX_SIZE (256 * 1024)
+
+/* Writing to the SD card can take a long time, so logging a message only
+   copies it, with the time, into a ring of fixed-size slots in memory. A
+   background thread wakes up every LOG_FLUSH_INTERVAL ms (or sooner if the
+   ring is getting full), and appends everything in the ring to the log file,
+   which it keeps open, in as few writes as possible. A message that doesn't
+   fit in one slot continues in the following ones. If the ring is full, the
+   message is dropped and counted instead, and the count is logged when there
+   is room again.
+
+   Any thread can log a message. Each slot has a sequence number that tells
+   whose turn it is: a slot at position pos in the ring is free when its
+   sequence number is pos, and filled when it's pos + 1. Messages claim their
+   slots by advancing the head position with compare-and-swap, fill them,
+   and then publish them by setting their sequence numbers. The writer
+   thread empties slots in order, freeing each one by setting its sequence
+   number to pos + LOG_SLOTS, ready for the next time around the ring. */
+
+#define LOG_SLOTS 256
+#define LOG_CHUNK 112
+#define LOG_FLUSH_INTERVAL 1000
+
+/* Longest formatted message, beyond which it is truncated. */
+#define LOG_MAX_MESSAGE 1024
+
+struct Slot {
+    uint32_t sequence;
+    uint16_t count;		/* Slots in the message (first slot only). */
+    uint16_t length;		/* Bytes of the message in this slot. */
+    struct timespec time;	/* Time of the message (first slot only). */
+    char text[LOG_CHUNK];
+};
+
+static struct Slot ring[LOG_SLOTS];
+static uint32_t head = 0, tail = 0;
+static uint32_t dropped = 0;
+
+/* Futex word the writer thread sleeps on, and whether it should exit. */
+static uint32_t wakeup = 0;
+static bool stopping = false;
+
+static pthread_t writer;
+static bool writerStarted = false;
+static int logFd = -1;
+static off_t logSize = 0;
+
+static void initRing( void )
 {
-    time_t t;
-    static struct tm *tm;
-    static char s[100];
-
-    time(&t);
-    tm = localtime(&t);
-    strftime(s,sizeof(s),"%Y-%m-%d %H:%M:%S",tm);
-
-    FILE *fp = fopen(LOG_FILE,"a");
-    if( fp != NULL ) {
-	fprintf(fp,"%s %s\n",s,msg);
-        fclose(fp);
+    static bool initialized = false;
+    if( !initialized ) {
+	for( uint32_t i = 0; i < LOG_SLOTS; ++i )
+	    ring[i].sequence = i;
+	initialized = true;
     }
 }
 
-void WriteToLogArgI( const char *msg, int arg )
+static void wakeWriter( void )
+{
+    __atomic_add_fetch(&wakeup,1,__ATOMIC_RELEASE);
+    syscall(SYS_futex,&wakeup,FUTEX_WAKE_PRIVATE,1,NULL,NULL,0);
+}
+
+/* Copy a message into the ring, returning false if it had to be dropped
+   (without counting it). */
+static bool logMessage( const char *text, int length )
+{
+    if( Replaying() ) {
+	ReplayOutput("log %.*s",length,text);
+	return( true );
+    }
+
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME,&now);
+
+    uint32_t count = length > 0 ? (length + LOG_CHUNK - 1) / LOG_CHUNK : 1;
+    if( count > LOG_SLOTS )
+	return( false );
+
+    /* Claim the slots. Since slots are freed in order, they are all free if
+       the last one is. */
+    uint32_t pos = __atomic_load_n(&head,__ATOMIC_RELAXED);
+    for( ;; ) {
+	struct Slot *last = &ring[(pos + count - 1) % LOG_SLOTS];
+	int32_t diff = __atomic_load_n(&last->sequence,__ATOMIC_ACQUIRE)
+		     - (pos + count - 1);
+	if( diff < 0 )
+	    return( false );
+	if( diff == 0
+	 && __atomic_compare_exchange_n(&head,&pos,pos + count,true,
+					__ATOMIC_RELAXED,__ATOMIC_RELAXED) )
+	    break;
+	if( diff > 0 )
+	    pos = __atomic_load_n(&head,__ATOMIC_RELAXED);
+    }
+
+    /* Fill and publish them. */
+    for( uint32_t i = 0; i < count; ++i ) {
+	struct Slot *slot = &ring[(pos + i) % LOG_SLOTS];
+	int n = length - i * LOG_CHUNK;
+	slot->count = count;
+	slot->length = n < LOG_CHUNK ? n : LOG_CHUNK;
+	slot->time = now;
+	memcpy(slot->text,text + i * LOG_CHUNK,slot->length);
+	__atomic_store_n(&slot->sequence,pos + i + 1,__ATOMIC_RELEASE);
+    }
+
+    /* Don't wait for the writer to wake up on its own if the ring is more
+       than half full. */
+    if( pos + count - __atomic_load_n(&tail,__ATOMIC_RELAXED) > LOG_SLOTS / 2 )
+	wakeWriter();
+    return( true );
+}
+
+static void countDropped( uint32_t n )
+{
+    __atomic_add_fetch(&dropped,n,__ATOMIC_RELAXED);
+}
+
+void WriteToLog( const char *msg )
 {
-    char buf[100];
-    sprintf(buf,msg,arg);
-    WriteToLog(buf);
+    initRing();
+    if( !logMessage(msg,strlen(msg)) )
+	countDropped(1);
 }
 
-void WriteToLogArgF( const char *msg, double arg )
+void WriteToLogF( const char *format, ... )
 {
-    char buf[100];
-    sprintf(buf,msg,arg);
-    WriteToLog(buf);
+    char text[LOG_MAX_MESSAGE];
+    va_list args;
+    va_start(args,format);
+    int length = vsnprintf(text,sizeof(text),format,args);
+    va_end(args);
+
+    initRing();
+    if( length >= 0 ) {
+	if( length >= (int) sizeof(text) )
+	    length = sizeof(text) - 1;
+	if( !logMessage(text,length) )
+	    countDropped(1);
+    }
 }
 
 void RotateLogs( void )
 {
     unlink(LOG_FILE ".9");
     for( int i = 8; i >= 1; --i ) {
-        char from[80], to[80];
+	char from[80], to[80];
 	sprintf(from, LOG_FILE ".%d", i);
 	sprintf(to, LOG_FILE ".%d", i+1);
 	rename(from,to);
     }
     rename(LOG_FILE, LOG_FILE ".1");
 }
+
+static void writeLog( const char *buf, size_t n )
+{
+    if( logFd < 0 ) {
+	struct stat st;
+	if( (logFd = open(LOG_FILE,O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC,
+			  0644)) < 0 )
+	    return;
+	logSize = fstat(logFd,&st) == 0 ? st.st_size : 0;
+    }
+    if( write(logFd,buf,n) > 0 )
+	logSize += n;
+}
+
+/* Write out whatever is in the ring, as long as it has been completely
+   filled in. */
+static void flushRing( void )
+{
+    char buf[4096];
+    size_t n = 0;
+
+    for( ;; ) {
+	struct Slot *first = &ring[tail % LOG_SLOTS];
+	if( __atomic_load_n(&first->sequence,__ATOMIC_ACQUIRE) != tail + 1 )
+	    break;
+	uint32_t count = first->count;
+	struct Slot *last = &ring[(tail + count - 1) % LOG_SLOTS];
+	if( __atomic_load_n(&last->sequence,__ATOMIC_ACQUIRE)
+	    != tail + count )
+	    break;
+
+	if( n > sizeof(buf) - 32 - LOG_CHUNK ) {
+	    writeLog(buf,n);
+	    n = 0;
+	}
+
+	/* Rotate the log file between messages once it has grown too big. */
+	if( logFd >= 0 && logSize + n > LOG_MAX_SIZE ) {
+	    if( n > 0 )
+		writeLog(buf,n);
+	    n = 0;
+	    close(logFd);
+	    logFd = -1;
+	    RotateLogs();
+	}
+	struct tm tm;
+	localtime_r(&first->time.tv_sec,&tm);
+	n += strftime(buf + n,sizeof(buf) - n,"%Y-%m-%d %H:%M:%S ",&tm);
+	for( uint32_t i = 0; i < count; ++i ) {
+	    struct Slot *slot = &ring[(tail + i) % LOG_SLOTS];
+	    if( n + slot->length + 1 > sizeof(buf) ) {
+		writeLog(buf,n);
+		n = 0;
+	    }
+	    memcpy(buf + n,slot->text,slot->length);
+	    n += slot->length;
+	    __atomic_store_n(&slot->sequence,tail + i + LOG_SLOTS,
+			     __ATOMIC_RELEASE);
+	}
+	buf[n++] = '\n';
+	__atomic_store_n(&tail,tail + count,__ATOMIC_RELEASE);
+    }
+    if( n > 0 )
+	writeLog(buf,n);
+
+    /* Report any messages that had to be dropped, now that there's room. */
+    uint32_t lost = __atomic_exchange_n(&dropped,0,__ATOMIC_RELAXED);
+    if( lost > 0 ) {
+	char msg[40];
+	if( !logMessage(msg,sprintf(msg,"%u log messages dropped",lost)) )
+	    countDropped(lost);
+    }
+}
+
+static void *writeLogs( void *arg )
+{
+    while( !__atomic_load_n(&stopping,__ATOMIC_ACQUIRE) ) {
+	uint32_t w = __atomic_load_n(&wakeup,__ATOMIC_ACQUIRE);
+	flushRing();
+	struct timespec timeout = { LOG_FLUSH_INTERVAL / 1000,
+				    LOG_FLUSH_INTERVAL % 1000 * 1000000 };
+	syscall(SYS_futex,&wakeup,FUTEX_WAIT_PRIVATE,w,&timeout,NULL,0);
+    }
+    return( NULL );
+}
+
+void StartLogging( void )
+{
+    initRing();
+
+    /* Signals are meant for the main thread, so the writer blocks them. */
+    sigset_t all, old;
+    sigfillset(&all);
+    pthread_sigmask(SIG_SETMASK,&all,&old);
+    writerStarted = pthread_create(&writer,NULL,writeLogs,NULL) == 0;
+    pthread_sigmask(SIG_SETMASK,&old,NULL);
+}
+
+void StopLogging( void )
+{
+    if( writerStarted ) {
+	__atomic_store_n(&stopping,true,__ATOMIC_RELEASE);
+	wakeWriter();
+	pthread_join(writer,NULL);
+	writerStarted = false;
+    }
+
+    /* Write out anything logged since the writer last woke up (including
+       the count of any dropped messages). */
+    initRing();
+    flushRing();
+    flushRing();
+    if( logFd >= 0 ) {
+	close(logFd);
+	logFd = -1;
+    }
+}
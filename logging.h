@@ -20,9 +20,22 @@
 #ifndef __PI_TAB_DAEMON_LOGGING_H__
 #define __PI_TAB_DAEMON_LOGGING_H__
 
+/* Log a message, or a message formatted as by printf (truncated to 1023
+   characters), without waiting for it to be written to the log file. */
 extern void WriteToLog( const char *msg );
-extern void WriteToLogArgI( const char *msg, int arg );
-extern void WriteToLogArgF( const char *msg, double arg );
+extern void WriteToLogF( const char *format, ... )
+    __attribute__((format(printf,1,2)));
+
+/* Start the thread that writes logged messages to the log file (after
+   becoming a daemon, since threads don't survive a fork), and stop it,
+   writing out any messages that haven't been written yet. Messages logged
+   before logging starts are kept until it does. */
+extern void StartLogging( void );
+extern void StopLogging( void );
+
+/* Move the existing log files aside so a fresh one is started. This must
+   be done before logging starts, since the writer thread keeps the log file
+   open (and rotates it itself when it gets too big). */
 extern void RotateLogs( void );
 
 #endif
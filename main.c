@@ -28,19 +28,36 @@
 #include <getopt.h>
 #include <signal.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
+#include <sys/signalfd.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 
+#include "activity.h"
 #include "battery.h"
+#include "control.h"
 #include "display.h"
+#include "gesture.h"
 #include "idle.h"
 #include "io.h"
+#include "recorder.h"
 #include "logging.h"
+#include "power.h"
+#include "replay.h"
+#include "scan.h"
+#include "sched.h"
+#include "shed.h"
+#include "snapshot.h"
+#include "status.h"
+#include "wifi.h"
+#include "wm.h"
 
-/* RAM disk file used by the daemon to send status to the dashboard. */
+/* RAM disk file used by the daemon to send status to the dashboard in text
+   form, in addition to the shared memory status block (see status.h). */
 #define DAT_FILE	"/ram/pitabd.dat"
 
 /* Disk file where daemon's process ID is recorded so it can be killed. */
@@ -60,63 +77,921 @@
 #define DIM_TO_DARK	180000
 #define IDLE_RECOVERY	500
 
+/* Idle time in ms before display is dimmed when saving power. */
+#define SHED_IDLE_TO_DIM 30000
+
+/* Time in ms that a button must be held down to be considered a long press,
+   and within which it must be pressed again to be a double press. */
+#define LONG_PRESS	500
+#define DOUBLE_PRESS	300
+
+/* Intervals in ms between checks for commands from the dashboard (if the
+   command file can't be watched for changes), and between display brightness
+   adjustments. The inputs are scanned at their own interval (see scan.h). */
+#define CMD_INTERVAL	5000
+#define FADE_INTERVAL	16
+
+/* Time in ms to wait for a change to the Wi-Fi radio to take effect, and the
+   number of times to ask before giving up. */
+#define WIFI_CONFIRM_TIME 1000
+#define WIFI_ATTEMPTS	3
+
+/* Interval in ms between raw battery readings when logging battery usage. */
+#define RAW_LOG_INTERVAL 60000
+
 /* Command line options (in the form expected by getopt). */
-#define OPTIONS		"bkn"
+#define OPTIONS		"bB:C:e:f:g:H:kl:L:np:P:r:R:sS:t:T"
 
 static void usage( void )
 {
     /* Print usage information and exit. */
-    fprintf(stderr,"usage: pitabd [-%s]\n",OPTIONS);
+    fprintf(stderr,"usage: pitabd [-bknsT] [-B s] [-C cpu] [-e estimator]"
+		   " [-f ms] [-g chip] [-H rung=percent] [-l file] [-L s]"
+		   " [-p periods]"
+		   " [-P profile=governor,max,cpus] [-r ms] [-R priority] [-S dir]"
+		   " [-t trace]\n");
     fprintf(stderr,"-b\tlog detailed battery usage\n");
+    fprintf(stderr,"-B\tcompare battery estimators on simulated input for some"
+		   " seconds and exit\n");
+    fprintf(stderr,"-C\tpin the thread that scans the inputs to a CPU\n");
+    fprintf(stderr,"-e\tbattery estimator (adaptive, boxcar, burst, cic, or"
+		   " edges)\n");
+    fprintf(stderr,"-f\ttime to fade backlight from off to full (ms)\n");
+    fprintf(stderr,"-g\tuse GPIO character device (e.g. /dev/gpiochip0)\n");
+    fprintf(stderr,"-H\tbattery energy (%%) at which to shed load (brightness,"
+		   " idle,\n\tusb, wifi, or cpu), or hysteresis before"
+		   " restoring it\n");
     fprintf(stderr,"-k\tkill running pitabd and then exit\n");
+    fprintf(stderr,"-l\tbacklight brightness file to write to\n");
+    fprintf(stderr,"-L\ttest scanning latency for some seconds and then"
+		   " exit\n");
     fprintf(stderr,"-n\tdo not become a daemon, remain in foreground\n");
+    fprintf(stderr,"-p\tperiods of battery input to measure with -e edges\n");
+    fprintf(stderr,"-P\tCPU settings for a power profile (normal, saving, dim,"
+		   " or dark)\n");
+    fprintf(stderr,"-r\trecord battery readings at most every ms in flight"
+		   " recorder\n");
+    fprintf(stderr,"-R\tscan the inputs with real-time priority (1-99)\n");
+    fprintf(stderr,"-s\tonly report status through shared memory\n");
+    fprintf(stderr,"-S\tCPU settings directory (/sys/devices/system/cpu)\n");
+    fprintf(stderr,"-t\treplay a trace of the inputs, instead of monitoring"
+		   " them\n");
+    fprintf(stderr,"-T\trun self-checks and exit\n");
     exit(1);
 }
 
+/* State shared by the jobs below, which the scheduler runs as they become
+   due. */
+
+static bool optLogBattery = false, optStatusFile = true;
+static int optRecordInterval = 0;
+
+/* Time (ms) from which fresh battery readings are next recorded in the flight
+   recorder. */
+static int64_t nextBatteryRecord = 0;
+
+/* Previous state of each monitored quantity. */
+static bool charging = false, completed = false, pluggedIn = false;
+static double lastVoltage = -1, lastEnergy = -1;
+static double rAct, rAdj, v, e;
+static bool batteryReady = false;
+
+/* State of the display with respect to user idle time. */
+static enum { ACTIVE = 0, DIM, DARK } displayState = ACTIVE;
+
+/* Whether the display itself has been turned off, once the backlight has
+   faded out in the DARK state. */
+static bool displayOff = false;
+
+/* Current state of USB/Ethernet/Bluetooth, Wi-Fi, and idle dimming. */
+static bool usbOn = true, wifiOn = true, allowDim = true;
+
+/* State of USB/Ethernet/Bluetooth and Wi-Fi requested by the dashboard, which
+   load shedding may override. */
+static bool wantUSB = true, wantWifi = true;
+
+/* Ways in which power consumption is being reduced because the battery is
+   low (see shed.h), and the resulting idle time before dimming. */
+static int shedding = 0;
+static int idleToDim = IDLE_TO_DIM;
+
+/* Number of times the current Wi-Fi change has been requested. */
+static int wifiAttempts = 0;
+
+/* Whether the X server's idle alarms have been set, after which checkIdle
+   runs when they go off instead of checking the idle time periodically. */
+static bool idleAlarms = false;
+
+/* Jobs whose deadlines are changed by other jobs. */
+static int idleJob, lowBatteryJob, fadeJob, statusJob, wifiJob, gestureJob;
+
+/* Set when the daemon is told to terminate (usually because it is being
+   replaced by a new instance), as opposed to the system shutting down. */
+static volatile sig_atomic_t terminated = 0;
+
+static void terminate( int sig )
+{
+    terminated = 1;
+    StopScheduler();
+}
+
+/* Descriptor on which SIGUSR1 is received, which asks for the scheduler's
+   statistics to be logged. */
+static int statsFd = -1;
+
+static void logHistogram( const char *what, const uint32_t *histogram )
+{
+    char buf[STATS_BUCKETS * 24];
+    int n = 0;
+    for( int i = 0; i < STATS_BUCKETS; ++i ) {
+	if( histogram[i] == 0 )
+	    continue;
+	if( i < STATS_BUCKETS - 1 )
+	    n += sprintf(buf + n," <%lldus:%u",1LL << (i + 1),histogram[i]);
+	else
+	    n += sprintf(buf + n," >=%lldus:%u",1LL << i,histogram[i]);
+    }
+    buf[n] = '\0';
+    WriteToLogF("%s%s",what,buf);
+}
+
+static void logStats( void )
+{
+    struct signalfd_siginfo info;
+    while( read(statsFd,&info,sizeof(info)) == sizeof(info) )
+	;
+
+    struct SchedulerStats stats;
+    GetSchedulerStats(&stats);
+    logHistogram("job lateness",stats.lateness);
+    logHistogram("run time",stats.runTime);
+    WriteToLogF("worst stall %lldus in %s, %u missed deadlines",
+		(long long) stats.worstStall,
+		stats.worstStallCause != NULL ? stats.worstStallCause : "nothing",
+		stats.missedDeadlines);
+    WriteToLogF("%u missed scans, %u lost scan events, %.1f scan wake-ups/s",
+		GetMissedScans(),GetLostScanEvents(),GetScanWakeUpRate());
+
+    int64_t now = NowMs();
+    for( int i = 0; i < NUM_POWER_PROFILES; ++i )
+	WriteToLogF("%lld s in %s power profile",
+		    (long long) (GetPowerProfileTime(i,now) / 1000),
+		    GetPowerProfileName(i));
+}
+
+/* Check the idle time as soon as an idle alarm goes off. */
+static void readIdleEvents( void )
+{
+    if( ReadIdleEvents() )
+	ScheduleJob(idleJob,ASAP);
+}
+
+/* Note any activity on the input devices, which ends dimming right away. */
+static void readActivity( void )
+{
+    ReadActivity();
+    if( displayState != ACTIVE )
+	ScheduleJob(idleJob,ASAP);
+}
+
+/* Set or adjust the idle alarms (once the X server is running) and start
+   watching for them. */
+static void setIdleAlarms( void )
+{
+    if( InitIdleAlarms(idleToDim,idleToDim + DIM_TO_DARK) && !idleAlarms ) {
+	idleAlarms = true;
+	AddWatch("idle alarms",GetIdleFd(),readIdleEvents);
+    }
+}
+
+/* Start fading the display brightness towards a new target, unless it's
+   already fading. */
+static void startFade( void )
+{
+    if( GetJobDeadline(fadeJob) == NEVER )
+	ScheduleJob(fadeJob,ASAP);
+
+    /* Let the dashboard know about the new brightness or display state, and
+       record it. */
+    ScheduleJob(statusJob,ASAP);
+    Record(REC_DISPLAY,displayState,GetBrightnessIndex(),0);
+}
+
+/* Continue a fade, stopping once the target brightness is reached. Once
+   the backlight is off, turn off the display too, so it stops drawing power
+   for video output. */
+static void fadeBrightness( void )
+{
+    if( !NudgeBrightness(FADE_INTERVAL) ) {
+	ScheduleJob(fadeJob,NEVER);
+	if( displayState == DARK && !displayOff )
+	    displayOff = SetDisplayPower(false);
+    }
+}
+
+/* Turn the display back on before the backlight starts fading in, and log
+   how long after the user's activity that happened. */
+static void restoreDisplay( void )
+{
+    if( displayOff ) {
+	if( !SetDisplayPower(true) )
+	    WriteToLog("unable to turn display on");
+	int64_t last = LastActivity();
+	if( last >= 0 )
+	    WriteToLogF("display on %lldms after activity",
+			(long long) (NowMs() - last));
+	displayOff = false;
+    }
+    RestoreDisplay();
+}
+
+/* Put the CPUs into the power profile for the state of the display, unless
+   the charger is connected, or into power saving mode if load shedding calls
+   for it. */
+static void updatePowerProfile( void )
+{
+    int profile = POWER_NORMAL;
+    if( !pluggedIn ) {
+	if( displayState == DARK )
+	    profile = POWER_DARK;
+	else if( displayState == DIM )
+	    profile = POWER_DIM;
+	else if( shedding & SHED_CPU )
+	    profile = POWER_SAVING;
+    }
+    if( !SetPowerProfile(profile,NowMs()) )
+	WriteToLogF("unable to apply %s power profile",
+		    GetPowerProfileName(profile));
+}
+
+/* Restore the display if it's dimmed or blank when a button is pressed, and
+   reset the idle timer. */
+static void endIdle( int64_t now )
+{
+    if( displayState != ACTIVE ) {
+	restoreDisplay();
+	displayState = ACTIVE;
+	updatePowerProfile();
+	startFade();
+    }
+    ScheduleJob(idleJob,now + idleToDim);
+}
+
+/* Monitor changes to the two charging LEDs (charging and completed). If
+   either one is lit, then the charger must be connected. */
+static void chargerChanged( int64_t now )
+{
+    /* Record changes in charger-connected status. */
+    if( pluggedIn && !(charging || completed) ) {
+	WriteToLog("charger disconnected");
+	/* Ensure display doesn't dim immediately after unplugging. */
+	ScheduleJob(idleJob,now + idleToDim);
+	pluggedIn = false;
+    }
+    else if( !pluggedIn && (charging || completed) ) {
+	WriteToLog("charger connected");
+	pluggedIn = true;
+	if( displayState != ACTIVE )
+	    ScheduleJob(idleJob,ASAP);
+    }
+    updatePowerProfile();
+    ScheduleJob(statusJob,ASAP);
+}
+
+/* Button 1 brings either the on-screen keyboard (short press) or the
+   dashboard (long press) to the front. The application mustn't be in
+   fullscreen mode, otherwise nothing can be displayed on top of it. Idle
+   alarms may have been read from the X connection while waiting for replies
+   to window management requests. */
+static void showKeyboard( void )
+{
+    RemoveFullscreen();
+    ActivateWindow("xvkbd");
+    readIdleEvents();
+}
+
+static void showDashboard( void )
+{
+    RemoveFullscreen();
+    ActivateWindow("%");
+    readIdleEvents();
+}
+
+/* Button 2 cycles through the preprogrammed brightness levels (short press)
+   or jumps directly to maximum brightness (long press). */
+static void nextBrightness( void )
+{
+    NextBrightness();
+    startFade();
+}
+
+static void maxBrightness( void )
+{
+    MaxBrightness();
+    startFade();
+}
+
+/* Button 3 toggles maximized (short press) or fullscreen (long press) mode on
+   the foreground application. Fullscreen must be removed before toggling
+   maximization, or nothing will happen. */
+static void toggleMaximized( void )
+{
+    RemoveFullscreen();
+    ToggleMaximized();
+    readIdleEvents();
+}
+
+static void toggleFullscreen( void )
+{
+    ToggleFullscreen();
+    readIdleEvents();
+}
+
+/* What each gesture made with the buttons does (see gesture.h). */
+static const struct Gesture GESTURES[] = {
+    { GESTURE_PRESS,	  1 << BUTTON_1, showKeyboard },
+    { GESTURE_LONG_PRESS, 1 << BUTTON_1, showDashboard },
+    { GESTURE_PRESS,	  1 << BUTTON_2, nextBrightness },
+    { GESTURE_LONG_PRESS, 1 << BUTTON_2, maxBrightness },
+    { GESTURE_PRESS,	  1 << BUTTON_3, toggleMaximized },
+    { GESTURE_LONG_PRESS, 1 << BUTTON_3, toggleFullscreen }
+};
+
+/* Run the actions of gestures that were waiting on a button being held or
+   not pressed again. */
+static void checkGestures( void )
+{
+    ScheduleJob(gestureJob,CheckGestures(NowMs()));
+}
+
+/* Act on a change to the power switch, a button, or the charger status
+   inputs, which the scanner found at the specified time: 1 if the input
+   became active, or -1 if it became inactive. */
+static void actOnInput( int input, int c, int64_t now )
+{
+    switch( input ) {
+
+    /* Shut down if the power switch is turned off. */
+    case SWITCH_ON:
+	if( c == -1 ) {
+	    WriteToLog("shutdown initiated");
+	    StopScheduler();
+	}
+	break;
+
+    /* Pressing any button ends idleness, and what the buttons do depends on
+       the gestures they make. */
+    case BUTTON_1:
+    case BUTTON_2:
+    case BUTTON_3:
+	if( c == 1 )
+	    endIdle(now);
+	ScheduleJob(gestureJob,GestureInput(input,c == 1,now));
+	break;
+
+    case CHARGING:
+	charging = c == 1;
+	chargerChanged(now);
+	break;
+
+    case CHARGED:
+	if( c == 1 )
+	    WriteToLog("charging completed");
+	completed = c == 1;
+	chargerChanged(now);
+	break;
+
+    /* When the low battery input becomes active, schedule a shutdown. If it
+       ever becomes inactive, cancel the shutdown. If the deadline passes
+       with a consistent low battery signal, the system is shut down. */
+    case LOW_BATT:
+	ScheduleJob(lowBatteryJob,c == 1 ? now + LBO_TO_SHUTDOWN : NEVER);
+	break;
+    }
+}
+
+/* Turn USB, including wired Ethernet and Bluetooth, on or off. Bluetooth is
+   included only because we replaced the flakey built-in one with a
+   hard-wired USB dongle. */
+static void setUSB( bool on )
+{
+    if( Replaying() )
+	ReplayOutput("usb %s",on ? "on" : "off");
+    else {
+	FILE *fp = fopen("/sys/devices/platform/soc/3f980000.usb/buspower","w");
+	if( fp == NULL )
+	    return;
+	fprintf(fp,"%d\n",on);
+	fclose(fp);
+
+	/* Workaround for bug that lxpanel goes to 100% CPU, because the USB
+	   sound card goes away. Doesn't happen if the default audio is the
+	   built-in audio. */
+	if( !on )
+	    system("/usr/bin/lxpanelctl restart");
+    }
+    WriteToLog(on ? "enabled USB and Bluetooth" : "disabled USB and Bluetooth");
+    usbOn = on;
+}
+
+/* Turn Wi-Fi on or off. The radio's state is confirmed asynchronously by
+   readWifiEvents, and the request is retried by checkWifi if it doesn't
+   take effect. Until then, wifiOn says what was asked for. */
+// TODO - make these two separate options
+static void setWifi( bool on )
+{
+    RequestWifi(on);
+    wifiOn = on;
+    wifiAttempts = 1;
+    ScheduleJob(wifiJob,NowMs() + WIFI_CONFIRM_TIME);
+}
+
+/* Take the state of the Wi-Fi radio from rfkill, log it, and let the
+   dashboard know. */
+static void confirmWifi( void )
+{
+    wifiOn = IsWifiOn();
+    WriteToLog(wifiOn ? "enabled wifi" : "disabled wifi");
+    ScheduleJob(statusJob,ASAP);
+}
+
+/* Note any changes in the state of the Wi-Fi radio, and stop waiting for a
+   requested change once it has happened. */
+static void readWifiEvents( void )
+{
+    bool settled = ReadWifiEvents();
+    if( GetJobDeadline(wifiJob) != NEVER ) {
+	if( settled ) {
+	    ScheduleJob(wifiJob,NEVER);
+	    confirmWifi();
+	}
+    }
+    else if( IsWifiOn() != wifiOn )
+	confirmWifi();
+}
+
+/* If a requested change to the Wi-Fi radio hasn't happened yet, ask again,
+   up to a limit. If it still hasn't happened, go by the radio's actual
+   state, so that the change is asked for again the next time the power
+   settings are applied. */
+static void checkWifi( void )
+{
+    if( IsWifiSettled() )
+	confirmWifi();
+    else if( wifiAttempts++ < WIFI_ATTEMPTS ) {
+	RequestWifi(wifiOn);
+	ScheduleJob(wifiJob,NowMs() + WIFI_CONFIRM_TIME);
+    }
+    else {
+	WriteToLog(wifiOn ? "unable to enable wifi" : "unable to disable wifi");
+	wifiOn = IsWifiOn();
+	ScheduleJob(statusJob,ASAP);
+    }
+}
+
+/* Bring USB and Wi-Fi in line with what the dashboard asked for, unless
+   they're turned off to save power. */
+static void applyPowerSettings( void )
+{
+    bool usb = wantUSB && !(shedding & SHED_USB);
+    if( usb != usbOn )
+	setUSB(usb);
+
+    bool wifi = wantWifi && !(shedding & SHED_WIFI);
+    if( wifi != wifiOn )
+	setWifi(wifi);
+    ScheduleJob(statusJob,ASAP);
+}
+
+/* Put into effect the ways of reducing power consumption that are in the
+   specified mask, and undo any that aren't. */
+static void applyLoadShedding( int actions )
+{
+    int changes = actions ^ shedding;
+    shedding = actions;
+
+    LimitBrightness(actions & SHED_BRIGHTNESS);
+    if( changes & SHED_BRIGHTNESS )
+	startFade();
+    idleToDim = actions & SHED_IDLE ? SHED_IDLE_TO_DIM : IDLE_TO_DIM;
+    if( changes & SHED_IDLE && idleAlarms )
+	setIdleAlarms();
+    if( changes & SHED_IDLE && displayState == ACTIVE )
+	ScheduleJob(idleJob,NowMs());
+    if( changes & SHED_CPU )
+	updatePowerProfile();
+    applyPowerSettings();
+}
+
+/* Remember whether we want to allow dimming or not, and undo any dimming
+   right away if not. */
+static void setAllowDim( bool dim )
+{
+    allowDim = dim;
+    if( !allowDim && displayState != ACTIVE )
+	ScheduleJob(idleJob,ASAP);
+    ScheduleJob(statusJob,ASAP);
+}
+
+/* Look for commands from the dashboard in its command file. */
+static void checkCommands( void )
+{
+    FILE *fp = fopen(CMD_FILE,"r");
+    if( fp == NULL )
+        return;
+
+    /* Read the RAM disk command file that the dashboard writes to. */
+    int dim = 1, usb = 1, wifi = 1;
+    int nScanned = fscanf(fp,"%d %d %d",&dim,&usb,&wifi);
+    fclose(fp);
+
+    /* Act on the commands only if the read was successful. */
+    if( nScanned != 3 )
+        return;
+
+    /* Allow dimming or not, and turn USB and Wi-Fi on or off. */
+    setAllowDim(dim);
+    wantUSB = usb;
+    wantWifi = wifi;
+    applyPowerSettings();
+}
+
+/* Carry out commands sent by the dashboard through the control socket, or
+   reread the command file if it has changed. */
+static void readControl( void )
+{
+    int command, value;
+    while( (command = ReadCommand(&value)) != CONTROL_NONE ) {
+	int result = 0;
+	switch( command ) {
+	case CONTROL_FILE_CHANGED:
+	    checkCommands();
+	    break;
+	case CONTROL_DIM:
+	    setAllowDim(value != 0);
+	    break;
+	case CONTROL_USB:
+	    wantUSB = value != 0;
+	    applyPowerSettings();
+	    break;
+	case CONTROL_WIFI:
+	    wantWifi = value != 0;
+	    applyPowerSettings();
+	    break;
+	case CONTROL_BRIGHTNESS:
+	    if( SetBrightnessIndex(value) )
+		startFade();
+	    else
+		result = EINVAL;
+	    break;
+	default:
+	    result = EINVAL;
+	}
+	AckCommand(result);
+    }
+}
+
+/* Update the voltage and energy remaining from the scanner's latest battery
+   readings. */
+static void updateBattery( const struct ScanEvent *event )
+{
+    rAct = event->rAct;
+    rAdj = event->rAdj;
+    batteryReady = event->ready;
+    v = round(BatteryRawToVoltage(rAct) * 100.0) / 100.0;
+    e = round(BatteryRawToEnergyRemaining(rAdj));
+
+    /* Don't do anything that relies on battery readings until the battery
+       monitor has collected enough samples for an accurate reading. */
+    if( !batteryReady )
+	return;
+
+    /* Record the readings in the flight recorder as they arrive, but no
+       more often than asked for. */
+    if( optRecordInterval > 0 && event->time >= nextBatteryRecord ) {
+	Record(REC_BATTERY,charging,rAct,rAdj);
+	nextBatteryRecord = event->time + optRecordInterval;
+    }
+
+    /* If the rounded voltage has increased while charging, decreased
+       while discharging, or changed by more than 10mV, update it. */
+    if( charging && v > lastVoltage || !charging && v < lastVoltage
+     || fabs(v - lastVoltage) > 0.0101 )
+    {
+	if( optLogBattery )
+	    WriteToLogF("battery voltage %1.2fV",v);
+	lastVoltage = v;
+	ScheduleJob(statusJob,ASAP);
+    }
+
+    /* If the rounded energy remaining has increased while charging,
+       decreased while discharging, or changed by more than 1%, update
+       it. */
+    if( charging && e > lastEnergy || !charging && e < lastEnergy
+     || fabs(e - lastEnergy) > 1.01 )
+    {
+	if( optLogBattery )
+	    WriteToLogF("energy remaining %1.0f%%",e);
+	lastEnergy = e;
+	ScheduleJob(statusJob,ASAP);
+
+	/* Reduce power consumption as the battery runs down, and restore it
+	   once the battery is charging. */
+	int actions = UpdateLoadShedding(e,pluggedIn);
+	if( actions != shedding )
+	    applyLoadShedding(actions);
+    }
+}
+
+/* Act on the input changes and battery readings found by the scanner. */
+static void readScanEvents( void )
+{
+    ClearScanFd();
+    struct ScanEvent event;
+    while( GetScanEvent(&event) ) {
+	if( event.type == SCAN_INPUT )
+	    actOnInput(event.input,event.change,event.time);
+	else
+	    updateBattery(&event);
+    }
+}
+
+/* When replaying a trace, scan in step with the virtual clock instead. */
+static void scanAndAct( void )
+{
+    ScanInputs();
+    readScanEvents();
+}
+
+/* Log the raw battery reading periodically when logging battery usage. */
+static void logRawBattery( void )
+{
+    if( batteryReady )
+	WriteToLogF("raw battery %1.3f",rAct);
+}
+
+/* After two minutes of inactivity while running on batteries, dim the
+   screen. After three additional minutes, turn off the backlight. This
+   can be overridden by a no-dim command from the dashboard. */
+static void checkIdle( void )
+{
+    /* Once the X server is running, this is run when its idle alarms go
+       off instead of every IDLE_RECOVERY ms while the display is dimmed. */
+    if( !idleAlarms )
+	setIdleAlarms();
+
+    /* There's nothing to check while the charger is connected and the
+       display is on. The job is rescheduled when the charger is
+       disconnected or a button is pressed. */
+    if( displayState == ACTIVE && pluggedIn )
+	return;
+
+    int64_t now = NowMs();
+    int64_t recheck = idleAlarms ? NEVER : now + IDLE_RECOVERY;
+    int i = IdleTime();
+    switch( displayState ) {
+    case ACTIVE:
+	if( i >= idleToDim && allowDim ) {
+	    DimDisplay();
+	    displayState = DIM;
+	    ScheduleJob(idleJob,recheck);
+	}
+	else
+	    ScheduleJob(idleJob,now + idleToDim - i);
+	break;
+    case DIM:
+	if( i < idleToDim || !allowDim || pluggedIn ) {
+	    restoreDisplay();
+	    displayState = ACTIVE;
+	    ScheduleJob(idleJob,now + idleToDim - i);
+	}
+	else if( i >= idleToDim + DIM_TO_DARK && allowDim ) {
+	    DarkenDisplay();
+	    /* Bring dashboard to front so there's somewhere safe to
+	       tap. */
+	    RemoveFullscreen();
+	    ActivateWindow("%");
+	    displayState = DARK;
+	    ScheduleJob(idleJob,recheck);
+	}
+	else
+	    ScheduleJob(idleJob,recheck);
+	break;
+    case DARK:
+	if( i < idleToDim || !allowDim || pluggedIn ) {
+	    restoreDisplay();
+	    displayState = ACTIVE;
+	    ScheduleJob(idleJob,now + idleToDim - i);
+	}
+	else
+	    ScheduleJob(idleJob,recheck);
+	break;
+    }
+    if( !allowDim )
+	ScheduleJob(idleJob,now + idleToDim);
+    updatePowerProfile();
+    startFade();
+
+    /* An idle alarm may have been read while bringing the dashboard to the
+       front. */
+    if( displayState == DARK )
+	readIdleEvents();
+}
+
+/* Shut down once the low battery input has been active for long enough. */
+static void shutDownOnLowBattery( void )
+{
+    WriteToLogF("low battery at %1.2fV",v);
+    StopScheduler();
+}
+
+/* If anything changed that we want to tell the user about, update the
+   status block shared with the dashboard, and the RAM disk file if what it
+   contains has changed. */
+static void writeStatus( void )
+{
+    struct SchedulerStats stats;
+    GetSchedulerStats(&stats);
+    struct Status status = {
+	v, e, charging, completed, GetBrightnessIndex(), displayState,
+	usbOn, wifiOn, allowDim, stats.worstStall, stats.missedDeadlines
+    };
+    PublishStatus(&status);
+
+    static char lastLine[32];
+    char line[32];
+    if( !optStatusFile && !Replaying() )
+	return;
+    snprintf(line,sizeof(line),"%4.2f %2.0f %1d %1d\n",v,e,charging,completed);
+    if( strcmp(line,lastLine) == 0 )
+	return;
+
+    /* A replay reports what would have been written instead. */
+    if( Replaying() )
+	ReplayOutput("status %.*s",(int) strlen(line) - 1,line);
+    else {
+	FILE *fp = fopen(DAT_FILE,"w");
+	if( fp == NULL )
+	    return;
+	fputs(line,fp);
+	fclose(fp);
+    }
+    strcpy(lastLine,line);
+}
+
 int main( int argc, char **argv )
 {
+    /* Make sure everything logged is written out, however we exit. */
+    atexit(StopLogging);
+
     /* Process command line options. */
-    bool optLogBattery = false, optKillOnly = false, optDaemonize = true;
+    bool optKillOnly = false, optDaemonize = true, optSelfCheck = false;
+    const char *optGPIOChip = NULL, *optTrace = NULL;
+    int optPriority = 0, optCPU = -1, optLatencyTest = 0, optBatteryTest = 0;
     int c;
     while( (c = getopt(argc,argv,OPTIONS)) != -1 ) {
 	switch( c ) {
 	case 'b':
 	    optLogBattery = true;
 	    break;
+	case 'B':
+	    if( (optBatteryTest = atoi(optarg)) <= 0 )
+		usage();
+	    break;
+	case 'C':
+	    optCPU = atoi(optarg);
+	    if( optCPU < 0 || optCPU >= sysconf(_SC_NPROCESSORS_CONF) )
+		usage();
+	    break;
+	case 'e':
+	    if( !SetBatteryEstimator(optarg) )
+		usage();
+	    break;
+	case 'f':
+	    if( (c = atoi(optarg)) <= 0 )
+		usage();
+	    SetFadeTime(c);
+	    break;
+	case 'g':
+	    optGPIOChip = optarg;
+	    break;
+	case 'H':
+	    if( !ConfigureLoadShedding(optarg) )
+		usage();
+	    break;
 	case 'k':
 	    optKillOnly = true;
 	    break;
+	case 'l':
+	    SetBacklightFile(optarg);
+	    break;
+	case 'L':
+	    if( (optLatencyTest = atoi(optarg)) <= 0 )
+		usage();
+	    break;
 	case 'n':
 	    optDaemonize = false;
 	    break;
+	case 'p':
+	    if( !SetBatteryEdgePeriods(atoi(optarg)) )
+		usage();
+	    break;
+	case 'P':
+	    if( !ConfigurePowerProfile(optarg) )
+		usage();
+	    break;
+	case 'r':
+	    if( (optRecordInterval = atoi(optarg)) <= 0 )
+		usage();
+	    break;
+	case 'R':
+	    optPriority = atoi(optarg);
+	    if( optPriority < 1 || optPriority > 99 )
+		usage();
+	    break;
+	case 's':
+	    optStatusFile = false;
+	    break;
+	case 'S':
+	    SetPowerRoot(optarg);
+	    break;
+	case 't':
+	    optTrace = optarg;
+	    break;
+	case 'T':
+	    optSelfCheck = true;
+	    break;
 	default:
 	    usage();
 	}
     }
     if( optind < argc )
         usage();
+    SetScanRealtime(optPriority,optCPU);
+
+    /* Just test how promptly the inputs could be scanned if -L was
+       specified. */
+    if( optLatencyTest > 0 )
+	return( TestScanLatency(optLatencyTest) ? 0 : 1 );
+
+    /* Likewise, just compare the battery estimators if -B was specified. */
+    if( optBatteryTest > 0 ) {
+	CompareBatterySampling(optBatteryTest);
+	return( 0 );
+    }
+
+    /* Or just check that the code behaves exactly as it should if -T was
+       specified. */
+    if( optSelfCheck ) {
+	bool ok = CheckBatteryBitsets();
+	ok = CheckStatusSeqlock() && ok;
+	ok = CheckScanQueue() && ok;
+	return( ok ? 0 : 1 );
+    }
+
+    /* Replaying a trace involves nothing outside this process: no other
+       instance, no hardware, and no files shared with the dashboard. */
+    bool replay = optTrace != NULL;
+    if( replay ) {
+	optDaemonize = false;
+	optRecordInterval = 0;
+    }
 
     /* If there's an existing instance running, terminate it. */
-    FILE *fp = fopen(PID_FILE,"r");
+    FILE *fp = replay ? NULL : fopen(PID_FILE,"r");
     if( fp != NULL ) {
 	pid_t pid;
-	if( fscanf(fp,"%d",&pid) == 1 )
-	    kill(pid,SIGINT);
+	if( fscanf(fp,"%d",&pid) == 1 && kill(pid,SIGINT) == 0 ) {
+	    /* Give it up to 2s to save its state and exit. */
+	    for( int i = 0; i < 100 && kill(pid,0) == 0; ++i )
+		usleep(20000);
+	}
         fclose(fp);
 	unlink(PID_FILE);
-	WriteToLogArgI("killed %d",pid);
+	WriteToLogF("killed %d",pid);
     }
     
     /* Nothing left to do if -k was specified. */
     if( optKillOnly )
         return( 0 );
 
-    /* Initialize GPIO ports and battery monitoring. */
-    if( !InitGPIO() ) {
+    /* Initialize GPIO ports and battery monitoring, or the trace that takes
+       their place. */
+    if( replay ) {
+	if( !StartReplay(optTrace) || !InitGPIOReplay() ) {
+	    fprintf(stderr,"pitabd: unable to replay %s\n",optTrace);
+	    return( 1 );
+	}
+    }
+    else if( optGPIOChip != NULL ? !InitGPIOChip(optGPIOChip) : !InitGPIO() ) {
 	fprintf(stderr,"pitabd: failed to initialize GPIO\n");
 	return( 1 );
     }
     InitBattery();
+    if( BatteryNeedsEdges() && !WatchBatteryEdges() ) {
+	fprintf(stderr,"pitabd: unable to watch battery edges (needs -g)\n");
+	return( 1 );
+    }
 
     /* Do what it takes to become a daemon. */
     if( optDaemonize && daemon(0,0) != 0 ) {
@@ -124,24 +999,39 @@ int main( int argc, char **argv )
 	return( 1 );
     }
 
-    /* Record our process id so we know which process to kill if reinvoked. */
-    if( (fp = fopen(PID_FILE,"w")) == NULL ) {
-        fprintf(stderr,"pitabd: unable to record process ID\n");
+    /* Rotate the log files and write log messages to a fresh one in the
+       background from now on (unless they're going to standard output with
+       the rest of a replay's output). The rotation must come first, since
+       the writer thread keeps the log file open once it has written to it,
+       and rotates it itself after that. */
+    if( !replay ) {
+	RotateLogs();
+	StartLogging();
+    }
+
+    /* Keep a record of what happens in case we crash, if asked to. */
+    if( optRecordInterval > 0 && !InitRecorder(RECORDER_FILE) ) {
+	fprintf(stderr,"pitabd: unable to create flight recorder\n");
 	return( 1 );
     }
-    fprintf(fp,"%d\n",getpid());
-    fclose(fp);
 
-    /* Rotate the log files and start a fresh one. */
-    RotateLogs();
-    WriteToLogArgI("starting with pid=%d",getpid());
+    /* Record our process id so we know which process to kill if reinvoked. */
+    if( !replay ) {
+	if( (fp = fopen(PID_FILE,"w")) == NULL ) {
+	    fprintf(stderr,"pitabd: unable to record process ID\n");
+	    return( 1 );
+	}
+	fprintf(fp,"%d\n",getpid());
+	fclose(fp);
+	WriteToLogF("starting with pid=%d",getpid());
+    }
 
     /* Copy the saved command file to the RAM disk if it's not already there,
        so the dashboard can find its settings. */
     int brightnessIndex = -1;
-    if( (fp = fopen(CMD_FILE,"r")) != NULL )
+    if( !replay && (fp = fopen(CMD_FILE,"r")) != NULL )
         fclose(fp);
-    else if( (fp = fopen(CMD_SAVE_FILE,"r")) != NULL ) {
+    else if( !replay && (fp = fopen(CMD_SAVE_FILE,"r")) != NULL ) {
 	FILE *fp2 = fopen(CMD_FILE,"w");
 	if( fp2 != NULL ) {
 	    while( (c = fgetc(fp)) != -1 ) {
@@ -160,314 +1050,169 @@ int main( int argc, char **argv )
 	chmod(CMD_FILE,0666);
     }
 
-    /* Set initial display brightness, but never to zero, to avoid scares. */
-    InitBrightness(brightnessIndex + !brightnessIndex);
-
-    /* Keep track of how long we've had a consistent low battery warning and
-       shut down when it's been long enough. */
-    int cyclesSinceLBO = 0;
-
-    /* Initialize previous state of each monitored quantity. */
-    bool charging = false, completed = false;
-    double lastVoltage = -1, lastEnergy = -1;
-
-    /* Variables to keep track of idle time while minimizing X11 calls to
-       check the idle time. */
-    enum { ACTIVE = 0, DIM, DARK } displayState = ACTIVE;
-    int nextIdleCheck = IDLE_TO_DIM;
-
-    /* Cycle number after which a button press is considered a long press. */
-    int button1LongPress = 0, button2LongPress = 0, button3LongPress = 0;
-
-    /* Current state of USB/Ethernet/Bluetooth, Wi-Fi, and idle dimming. */
-    bool usbOn = true, wifiOn = true, allowDim = true;
-    
-    /* Loop forever, keeping track of how many cycles have taken place. */
-    for( int cycle = 0;; ++cycle ) {
-
-	/* Shut down if the power switch is turned off. */
-	if( GetInput(SWITCH_ON) == -1 ) {
-	    WriteToLog("shutdown initiated");
-	    break;
-	}
-
-	/* Button 1 brings either the on-screen keyboard (short press) or the
-	   dashboard (long press) to the front. */
-	bool endIdle = false;
-	c = GetInput(BUTTON_1);
-	if( c == 1 ) {
-	    button1LongPress = cycle + 500;
-	    endIdle = true;
-	}
-	else if( c == -1 ) {
-	    /* Ensure the application isn't in fullscreen mode, otherwise
-	       nothing can be displayed on top of it. */
-	    system("wmctrl -r :ACTIVE: -b remove,fullscreen");
-	    if( cycle > button1LongPress )
-		system("wmctrl -a \"%\"");
-	    else
-		system("wmctrl -a \"xvkbd\"");
-	}
-
-	/* Button 2 cycles through the preprogrammed brightness levels (short
-	   press) or jumps directly to maximum brightness (long press). */
-	c = GetInput(BUTTON_2);
-	if( c == 1 ) {
-	    button2LongPress = cycle + 500;
-	    endIdle = true;
-	}
-	else if( c == -1 ) {
-	    if( cycle > button2LongPress )
-	        MaxBrightness();
-	    else
-		NextBrightness();
-	}
+    /* If we're replacing a previous instance, carry on where it left off,
+       including the display brightness. Otherwise, set initial display
+       brightness, but never to zero, to avoid scares. */
+    struct DaemonState state;
+    bool restored = !replay && LoadSnapshot(&state);
+    if( restored ) {
+	lastVoltage = state.lastVoltage;
+	lastEnergy = state.lastEnergy;
+	displayState = state.displayState;
+	displayOff = displayState == DARK;
+	charging = state.charging;
+	completed = state.completed;
+	pluggedIn = state.pluggedIn;
+	usbOn = state.usbOn;
+	wifiOn = state.wifiOn;
+	allowDim = state.allowDim;
+	shedding = state.shedding;
+	SetLoadShedding(shedding);
+	LimitBrightness(shedding & SHED_BRIGHTNESS);
+	idleToDim = shedding & SHED_IDLE ? SHED_IDLE_TO_DIM : IDLE_TO_DIM;
+	WriteToLog("restored state of previous instance");
+    }
+    else
+	InitBrightness(brightnessIndex + !brightnessIndex);
 
-	/* Button 3 toggles maximized (short press) or fullscreen (long press)
-	   mode on the foreground application. */
-	c = GetInput(BUTTON_3);
-	if( c == 1 ) {
-	    button3LongPress = cycle + 500;
-	    endIdle = true;
-	}
-	else if( c == -1 ) {
-	    if( cycle > button3LongPress )
-		system("wmctrl -r :ACTIVE: -b toggle,fullscreen");
-	    else {
-		/* Remove fullscreen before toggling maximization, or nothing
-		   will happen. */
-		system("wmctrl -r :ACTIVE: -b remove,fullscreen");
-		system("wmctrl -r :ACTIVE: -b toggle,maximized_vert,maximized_horz");
-	    }
-	}
+    /* Schedule the jobs that make up the daemon. Jobs due at the same time
+       run in this order. The display brightness is moved towards the
+       desired brightness every 16 milliseconds, but only while it's fading
+       (which it may be if we're carrying on from a previous instance). */
+    if( !InitScheduler() ) {
+	WriteToLog("failed to initialize scheduler");
+	return( 1 );
+    }
+    int64_t now = NowMs();
 
-	/* If the display is currently dimmed or blank, pressing any button
-	   will restore it. Button presses also reset the idle timer. */
-	if( endIdle ) {
-	    if( displayState != ACTIVE ) {
-		RestoreDisplay();
-		displayState = ACTIVE;
-	    }
-	    nextIdleCheck = cycle + IDLE_TO_DIM;
-	}
-	
-	/* Look for commands from the dashboard every 5 seconds. */
-	if( cycle % 5000 == 0 && (fp = fopen(CMD_FILE,"r")) != NULL ) {
-
-	    /* Read the RAM disk command file that the dashboard writes to. */
-	    int wantDim = 1, wantUSB = 1, wantWifi = 1;
-	    int nScanned = fscanf(fp,"%d %d %d",&wantDim,&wantUSB,&wantWifi);
-	    fclose(fp);
-
-	    /* Act on the commands only if the read was successful. */
-	    if( nScanned == 3 ) {
-
-		/* Remember whether we want to allow dimming or not. */
-		allowDim = wantDim;
-		
-		/* Turn USB, including wired Ethernet and Bluetooth, on or off.
-		   Bluetooth is included only because we replaced the flakey
-		   built-in one with a hard-wired USB dongle. */
-		if( usbOn && !wantUSB ) {
-		    /* Turn off USB, wired Ethernet, and Bluetooth. */
-		    if( (fp = fopen("/sys/devices/platform/soc/3f980000.usb/buspower","w")) != NULL ) {
-			fprintf(fp,"0\n");
-			fclose(fp);
-			/* Workaround for bug that lxpanel goes to 100% CPU,
-			   because the USB sound card goes away. Doesn't happen
-			   if the default audio is the built-in audio. */
-			system("/usr/bin/lxpanelctl restart");
-			WriteToLog("disabled USB and Bluetooth");
-			usbOn = false;
-		    }
-		}
-		else if( !usbOn && wantUSB ) {
-		    /* Turn on USB, wired Ethernet, and Bluetooth. */
-		    if( (fp = fopen("/sys/devices/platform/soc/3f980000.usb/buspower","w")) != NULL ) {
-			fprintf(fp,"1\n");
-			fclose(fp);
-			WriteToLog("enabled USB and Bluetooth");
-			usbOn = true;
-		    }
-		}
+    /* The inputs are scanned by a thread of their own, and whatever it finds
+       is acted on as it arrives, except when replaying a trace. */
+    if( replay )
+	AddJob("scan inputs",scanAndAct,now,SCAN_INTERVAL);
+    else if( StartScanThread() ) {
+	AddWatch("scan events",GetScanFd(),readScanEvents);
+	if( optPriority > 0 && !IsScanRealtime() )
+	    WriteToLog("unable to scan inputs with real-time priority");
+    }
+    else {
+	WriteToLog("failed to start scanning inputs");
+	return( 1 );
+    }
+    if( !replay )
+	AddJob("check commands",checkCommands,now,
+	       WatchCommandFile(CMD_FILE) ? 0 : CMD_INTERVAL);
+    if( optLogBattery )
+	AddJob("log battery",logRawBattery,now + RAW_LOG_INTERVAL,
+	       RAW_LOG_INTERVAL);
+    idleJob = AddJob("check idle",checkIdle,now + IDLE_TO_DIM,0);
+    lowBatteryJob = AddJob("low battery",shutDownOnLowBattery,NEVER,0);
+    fadeJob = AddJob("fade",fadeBrightness,now,FADE_INTERVAL);
+    statusJob = AddJob("write status",writeStatus,NEVER,0);
+    wifiJob = AddJob("check wifi",checkWifi,NEVER,0);
+    gestureJob = AddJob("check gestures",checkGestures,NEVER,0);
+    SetGestures(GESTURES,sizeof(GESTURES) / sizeof(struct Gesture));
+    for( int b = BUTTON_1; b <= BUTTON_3; ++b )
+	SetGestureTiming(b,LONG_PRESS,DOUBLE_PRESS);
 
-		/* Turn Wi-Fi on or off. */
-		// TODO - make these two separate options
-		// TODO - make sure the wifi is actually turned off
-		//        iwconfig wlan0 txpower off
-		// To turn it back on, do this twice:
-		//        iwconfig wlan0 txpower auto
-		if( wifiOn && !wantWifi  ) {
-		    /* Turn off Wi-Fi. */
-		    system("/sbin/iwconfig wlan0 txpower off");
-		    WriteToLog("disabled wifi");
-		    wifiOn = false;
-		}
-		else if( !wifiOn && wantWifi ) {
-		    /* Turn on Wi-Fi. */
-		    system("/sbin/iwconfig wlan0 txpower auto");
-		    /* Yes, we have to do this twice. Do we need a delay? */
-		    system("/sbin/iwconfig wlan0 txpower auto");
-		    WriteToLog("enabled wifi");
-		    wifiOn = true;
-		}
-	    }
-	}
+    /* Start in the power profile for the state we're in, which may have
+       been carried over from a previous instance. */
+    updatePowerProfile();
 
-	/* Monitor changes to the two charging LEDs (charging and completed).
-	   If either one is lit, then the charger must be connected. */
-	bool pluggedIn = charging || completed;
-	bool changed = false;
+    /* A replay simply stops at the end of the trace. */
+    if( replay )
+	AddJob("end of trace",StopScheduler,GetTraceEnd(),0);
+    else {
+	/* Report status to the dashboard through shared memory. */
+	if( !InitStatus(STATUS_FILE) )
+	    WriteToLog("unable to create status block");
 
-	/* Check status of charging LED. */
-	c = GetInput(CHARGING);
-	if( c == 1 ) {
-	    charging = true;
-	    changed = true;
-	}
-	else if( c == -1 ) {
-	    charging = false;
-	    changed = true;
-	}
+	/* Accept commands from the dashboard through the control socket, as
+	   well as changes to the command file. */
+	if( !InitControlSocket(CONTROL_SOCKET) )
+	    WriteToLog("unable to create control socket");
+	AddWatch("control",GetControlFd(),readControl);
 
-	/* Check and record status of charge-completed LED. */
-	c = GetInput(CHARGED);
-	if( c == 1 ) {
-	    WriteToLog("charging completed");
-	    completed = true;
-	    changed = true;
-	}
-	else if( c == -1 ) {
-	    completed = false;
-	    changed = true;
-	}
+	/* Watch the input devices for user activity, whether or not X is
+	   running. */
+	if( InitActivity() )
+	    AddWatch("activity",GetActivityFd(),readActivity);
+	else
+	    WriteToLog("unable to watch input devices");
 
-	/* Record changes in charger-connected status. */
-	if( pluggedIn && !(charging || completed) ) {
-	    WriteToLog("charger disconnected");
-	    /* Ensure display doesn't dim immediately after unplugging. */
-	    nextIdleCheck = cycle + IDLE_TO_DIM;
-	    pluggedIn = false;
+	/* Find out whether Wi-Fi is actually on, and watch for it changing. */
+	if( InitWifi() ) {
+	    wifiOn = IsWifiOn();
+	    AddWatch("wifi events",GetWifiFd(),readWifiEvents);
 	}
-	else if( !pluggedIn && (charging || completed) ) {
-	    WriteToLog("charger connected");
-	    pluggedIn = true;
-	}
-
-	/* Read battery state. This will be inaccurate until BATTERY_SAMPLES
-	   cycles have been completed. */
-	double rAdj, rAct = GetRawBatteryReadings(charging,&rAdj);
-	double v = round(BatteryRawToVoltage(rAct) * 100.0) / 100.0;
-	double e = round(BatteryRawToEnergyRemaining(rAdj));
-
-	/* Don't do anything that relies on battery readings until the battery
-	   monitor has collected enough samples for an accurate reading. */
-	if( cycle >= BATTERY_SAMPLES ) {
-
-	    /* If the rounded voltage has increased while charging, decreased
-	       while discharging, or changed by more than 10mV, update it. */
-	    if( charging && v > lastVoltage || !charging && v < lastVoltage
-	     || fabs(v - lastVoltage) > 0.0101 )
-	    {
-		if( optLogBattery )
-		    WriteToLogArgF("battery voltage %1.2fV",v);
-		lastVoltage = v;
-		changed = true;
-	    }
+	else
+	    WriteToLog("unable to control wifi");
+    }
 
-	    /* If the rounded energy remaining has increased while charging,
-	       decreased while discharging, or changed by more than 1%, update
-	       it. */
-	    if( charging && e > lastEnergy || !charging && e < lastEnergy
-	     || fabs(e - lastEnergy) > 1.01 )
-	    {
-		if( optLogBattery )
-		    WriteToLogArgF("energy remaining %1.0f%%",e);
-		lastEnergy = e;
-		changed = true;
-	    }
+    /* Pick up any deadlines and status changes from the previous instance. */
+    if( restored ) {
+	if( state.lowBatteryTime >= 0 )
+	    ScheduleJob(lowBatteryJob,now + state.lowBatteryTime);
+	if( displayState != ACTIVE )
+	    ScheduleJob(idleJob,now + IDLE_RECOVERY);
+	ScheduleJob(statusJob,ASAP);
+    }
 
-	    /* Log the raw battery reading once per minute when stable. */
-	    if( optLogBattery && cycle % 60000 == BATTERY_SAMPLES )
-	        WriteToLogArgF("raw battery %1.3f",rAct);
-	}
+    /* Terminate cleanly if asked to, so a new instance can take over. */
+    struct sigaction sa;
+    sa.sa_handler = terminate;
+    sigemptyset(&sa.sa_mask);
+    sa.sa_flags = 0;
+    sigaction(SIGINT,&sa,NULL);
+    sigaction(SIGTERM,&sa,NULL);
 
-	/* After two minutes of inactivity while running on batteries, dim the
-	   screen. After three additional minutes, turn off the backlight. This
-	   can be overridden by a no-dim command from the dashboard. */
-	if( cycle > nextIdleCheck && (displayState != ACTIVE || !pluggedIn) ) {
-	    int i = IdleTime();
-	    switch( displayState ) {
-	    case ACTIVE:
-		if( i > IDLE_TO_DIM && allowDim ) {
-		    DimDisplay();
-		    displayState = DIM;
-		    nextIdleCheck = cycle + IDLE_RECOVERY;
-		}
-		else
-		    nextIdleCheck = cycle + IDLE_TO_DIM - i;
-		break;
-	    case DIM:
-	        if( i < IDLE_TO_DIM || !allowDim || pluggedIn ) {
-		    RestoreDisplay();
-		    displayState = ACTIVE;
-		    nextIdleCheck = cycle + IDLE_TO_DIM - i;
-		}
-		else if( i > IDLE_TO_DIM + DIM_TO_DARK && allowDim ) {
-		    DarkenDisplay();
-		    /* Bring dashboard to front so there's somewhere safe to
-		       tap. */
-		    system("wmctrl -r :ACTIVE: -b remove,fullscreen");
-		    system("wmctrl -a \"%\"");
-		    displayState = DARK;
-		    nextIdleCheck = cycle + IDLE_RECOVERY;
-		}
-		else
-		    nextIdleCheck = cycle + IDLE_RECOVERY;
-		break;
-	    case DARK:
-	        if( i < IDLE_TO_DIM || !allowDim || pluggedIn ) {
-		    RestoreDisplay();
-		    displayState = ACTIVE;
-		    nextIdleCheck = cycle + IDLE_TO_DIM - i;
-		}
-		else
-		    nextIdleCheck = cycle + IDLE_RECOVERY;
-		break;
-	    }
-	    if( !allowDim )
-		nextIdleCheck = cycle + IDLE_TO_DIM;
-	}
+    /* Log how well the scheduler is keeping up when asked to. */
+    sigset_t usr1;
+    sigemptyset(&usr1);
+    sigaddset(&usr1,SIGUSR1);
+    sigprocmask(SIG_BLOCK,&usr1,NULL);
+    if( (statsFd = signalfd(-1,&usr1,SFD_NONBLOCK | SFD_CLOEXEC)) >= 0 )
+	AddWatch("statistics",statsFd,logStats);
 
-	/* When the low battery input becomes active, start a counter. If it
-	   ever becomes inactive, stop and reset the counter. If the counter
-	   reaches the specified limit with a consistent low battery signal,
-	   shut down the system. */
-	int lbo = GetInput(LOW_BATT);
-	if( lbo == 1 )
-	    cyclesSinceLBO = 1;
-	else if( lbo == -1 )
-	    cyclesSinceLBO = 0;
-	else if( cyclesSinceLBO > 0 && ++cyclesSinceLBO >= LBO_TO_SHUTDOWN ) {
-	    WriteToLogArgF("low battery at %1.2fV",v);
-	    break;
-	}
+    /* Run until the power switch is turned off or the battery runs low.
+       Then stop scanning, so that the state of the inputs and battery
+       readings can be saved. */
+    RunScheduler();
+    StopScanThread();
 
-	/* Move the display brightness towards the desired brightness by about
-	   5% every 16 milliseconds (off to full in about 1 second). */
-	if( cycle % 16 == 0 )
-	    NudgeBrightness();
+    /* A replay leaves nothing behind but its output. */
+    if( replay ) {
+	FinishReplay();
+	return( 0 );
+    }
 
-	/* If anything changed that we want to tell the user about, update the
-	   RAM disk file monitored by the dashboard. */
-	if( changed && (fp = fopen(DAT_FILE,"w")) != NULL ) {
-	    fprintf(fp,"%4.2f %2.0f %1d %1d\n",v,e,charging,completed);
-	    fclose(fp);
-	}
+    /* Leave the CPUs and the X server's DPMS settings as they would be
+       without us, in case there is no instance to replace us. */
+    SetPowerProfile(POWER_NORMAL,NowMs());
+    RestoreDisplayPower();
 
-	/* Sleep for approximately 1ms between scans (sleep time is tweaked
-	   slightly to allow for overhead). */
-	usleep(927);
+    /* If we were told to terminate, save our state for the instance that is
+       replacing us instead of shutting down. */
+    if( terminated ) {
+	state.lastVoltage = lastVoltage;
+	state.lastEnergy = lastEnergy;
+	state.displayState = displayState;
+	state.charging = charging;
+	state.completed = completed;
+	state.pluggedIn = pluggedIn;
+	state.usbOn = usbOn;
+	state.wifiOn = wifiOn;
+	state.allowDim = allowDim;
+	state.shedding = shedding;
+	int64_t deadline = GetJobDeadline(lowBatteryJob);
+	state.lowBatteryTime = deadline == NEVER ? -1 : deadline - NowMs();
+	if( deadline != NEVER && state.lowBatteryTime < 0 )
+	    state.lowBatteryTime = 0;
+	if( SaveSnapshot(&state) )
+	    WriteToLog("terminated, state saved");
+	else
+	    WriteToLog("terminated, unable to save state");
+	unlink(PID_FILE);
+	return( 0 );
     }
 
     /* Copy the command file back to its persistent location for next time. */
@@ -486,6 +1231,7 @@ int main( int argc, char **argv )
 
     /* Perform an orderly shutdown. */
     unlink(PID_FILE);
+    StopLogging();
     // system("/usr/bin/aplay /usr/local/share/pitabd/shutdown.wav");
     system("/sbin/shutdown now");
 
@@ -0,0 +1,60 @@
+/* PiTabDaemon - Allocation Counter */
+
+/* Copyright (c) 2017 by Stefan Vorkoetter
+
+   This file is part of PiTabDaemon.
+
+   PiTabDaemon is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   PiTabDaemon is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with PiTabDaemon. If not, see <http://www.gnu.org/licenses/>. */
+
+#define _GNU_SOURCE
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* Counts the daemon's memory allocations while it replays a trace, for
+   pitabreplay, which preloads it (LD_PRELOAD=pitaballoc.so) into the daemon.
+   Every call to malloc, calloc, or realloc passes through these, which take
+   the place of the C library's own (as glibc allows) and pass the call on to
+   its implementation. This is kept out of the daemon itself so that its
+   allocations aren't wrapped on the tablet just to report a statistic. The
+   daemon finds CountedAllocations if it has been preloaded (see replay.c). */
+
+extern void *__libc_malloc( size_t size );
+extern void *__libc_calloc( size_t n, size_t size );
+extern void *__libc_realloc( void *p, size_t size );
+
+static uint64_t allocations;
+
+void *malloc( size_t size )
+{
+    __atomic_add_fetch(&allocations,1,__ATOMIC_RELAXED);
+    return( __libc_malloc(size) );
+}
+
+void *calloc( size_t n, size_t size )
+{
+    __atomic_add_fetch(&allocations,1,__ATOMIC_RELAXED);
+    return( __libc_calloc(n,size) );
+}
+
+void *realloc( void *p, size_t size )
+{
+    __atomic_add_fetch(&allocations,1,__ATOMIC_RELAXED);
+    return( __libc_realloc(p,size) );
+}
+
+uint64_t CountedAllocations( void )
+{
+    return( __atomic_load_n(&allocations,__ATOMIC_RELAXED) );
+}
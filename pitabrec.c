@@ -0,0 +1,163 @@
+/* PiTabDaemon - Flight Recorder Decoder */
+
+/* Copyright (c) 2017 by Stefan Vorkoetter
+
+   This file is part of PiTabDaemon.
+
+   PiTabDaemon is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   PiTabDaemon is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with PiTabDaemon. If not, see <http://www.gnu.org/licenses/>. */
+
+#include <getopt.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "io.h"
+#include "recorder.h"
+
+/* Dumps the records in the daemon's flight recorder file (or a copy of it),
+   oldest first, as text or as CSV, or as a trace of the inputs and battery
+   readings that pitabd -t can replay (see replay.c). */
+
+static const char *INPUT_NAMES[] = {
+    "switch", "button1", "button2", "button3", "lowbatt", "charging",
+    "charged"
+};
+
+static const char *DISPLAY_STATES[] = { "active", "dim", "dark" };
+
+static void usage( void )
+{
+    fprintf(stderr,"usage: pitabrec [-ct] [file]\n");
+    fprintf(stderr,"-c\toutput CSV (time,type,arg,value0,value1)\n");
+    fprintf(stderr,"-t\toutput a trace to replay with pitabd -t\n");
+    exit(1);
+}
+
+int main( int argc, char **argv )
+{
+    bool optCSV = false, optTrace = false;
+    int c;
+    while( (c = getopt(argc,argv,"ct")) != -1 ) {
+	switch( c ) {
+	case 'c':
+	    optCSV = true;
+	    break;
+	case 't':
+	    optTrace = true;
+	    break;
+	default:
+	    usage();
+	}
+    }
+    if( optind < argc - 1 )
+	usage();
+    const char *path = optind < argc ? argv[optind] : RECORDER_FILE;
+
+    /* Read the whole file at once, so that what we dump is consistent even if
+       the daemon is still recording. */
+    FILE *fp = fopen(path,"rb");
+    if( fp == NULL ) {
+	perror(path);
+	return( 1 );
+    }
+    struct RecorderHeader header;
+    static struct Record records[RECORDER_RECORDS];
+    if( fread(&header,sizeof(header),1,fp) != 1
+     || header.magic != RECORDER_MAGIC
+     || header.version != RECORDER_VERSION
+     || header.recordSize != sizeof(struct Record)
+     || header.numRecords != RECORDER_RECORDS
+     || fread(records,sizeof(struct Record),RECORDER_RECORDS,fp)
+	!= RECORDER_RECORDS ) {
+	fprintf(stderr,"pitabrec: %s is not a flight recorder file\n",path);
+	return( 1 );
+    }
+    fclose(fp);
+
+    if( optCSV )
+	printf("time,type,arg,value0,value1\n");
+
+    /* Times in a trace are in ms from the first record. */
+    uint64_t start = 0, end = 0;
+    bool started = false;
+
+    uint64_t first = header.count > RECORDER_RECORDS
+		   ? header.count - RECORDER_RECORDS : 0;
+    for( uint64_t n = first; n < header.count; ++n ) {
+	const struct Record *rec = &records[n % RECORDER_RECORDS];
+	if( rec->sequence != (uint32_t) (n + 1) ) {
+	    if( !optCSV && !optTrace )
+		printf("(record %llu incomplete)\n",(unsigned long long) n);
+	    continue;
+	}
+
+	if( optTrace ) {
+	    if( !started ) {
+		start = rec->time;
+		started = true;
+	    }
+	    end = (rec->time - start) / 1000;
+	    if( rec->type == REC_INPUT && rec->arg <= CHARGED )
+		printf("%llu\t%s\t%d\n",(unsigned long long) end,
+		       INPUT_NAMES[rec->arg],rec->value[0] > 0);
+	    else if( rec->type == REC_BATTERY )
+		printf("%llu\tbattery\t%.4f\n",(unsigned long long) end,
+		       rec->value[0]);
+	    continue;
+	}
+
+	/* Convert the time to wall clock time. */
+	int64_t us = header.realTime + (int64_t) (rec->time - header.monotonicTime);
+	if( optCSV ) {
+	    printf("%lld.%06lld,%d,%d,%g,%g\n",(long long) (us / 1000000),
+		   (long long) (us % 1000000),rec->type,rec->arg,
+		   rec->value[0],rec->value[1]);
+	    continue;
+	}
+	time_t t = us / 1000000;
+	char s[32];
+	strftime(s,sizeof(s),"%Y-%m-%d %H:%M:%S",localtime(&t));
+	printf("%s.%06lld ",s,(long long) (us % 1000000));
+
+	switch( rec->type ) {
+	case REC_START:
+	    printf("started pid=%.0f\n",rec->value[0]);
+	    break;
+	case REC_BATTERY:
+	    printf("battery rAct=%.4f rAdj=%.4f%s\n",rec->value[0],
+		   rec->value[1],rec->arg ? " charging" : "");
+	    break;
+	case REC_INPUT:
+	    if( rec->arg <= CHARGED )
+		printf("input %s %s\n",INPUT_NAMES[rec->arg],
+		       rec->value[0] > 0 ? "on" : "off");
+	    else
+		printf("input %d %.0f\n",rec->arg,rec->value[0]);
+	    break;
+	case REC_DISPLAY:
+	    printf("display %s brightness=%.0f\n",
+		   rec->arg <= 2 ? DISPLAY_STATES[rec->arg] : "?",
+		   rec->value[0]);
+	    break;
+	default:
+	    printf("type %d arg=%d %g %g\n",rec->type,rec->arg,rec->value[0],
+		   rec->value[1]);
+	}
+    }
+    if( optTrace )
+	printf("%llu\tend\n",(unsigned long long) end);
+    return( 0 );
+}
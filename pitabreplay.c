@@ -0,0 +1,231 @@
+/* PiTabDaemon - Trace Replay Harness */
+
+/* Copyright (c) 2017 by Stefan Vorkoetter
+
+   This file is part of PiTabDaemon.
+
+   PiTabDaemon is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   PiTabDaemon is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with PiTabDaemon. If not, see <http://www.gnu.org/licenses/>. */
+
+#define _GNU_SOURCE
+
+#include <fcntl.h>
+#include <getopt.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/ptrace.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+
+/* Replays a trace through pitabd -t (see replay.c), and checks that what the
+   daemon did is exactly what it did before, by comparing its output with
+   the output saved from an earlier version. The daemon reports how quickly
+   the trace was replayed, and how many memory allocations it made, which
+   are counted by pitaballoc.so, preloaded into the daemon. Since system
+   calls can't be counted from inside the process, they are counted on a
+   second run of the replay, under ptrace (which slows it down too much to
+   time it at the same time). */
+
+/* Library that counts the daemon's allocations, or NULL if there isn't one. */
+static const char *allocCounter = "./pitaballoc.so";
+
+static void usage( void )
+{
+    fprintf(stderr,"usage: pitabreplay [-s] [-a counter] [-d daemon] trace "
+		   "[expected]\n");
+    fprintf(stderr,"-a\tallocation counter to preload "
+		   "(default ./pitaballoc.so)\n");
+    fprintf(stderr,"-d\tdaemon to run (default ./pitabd)\n");
+    fprintf(stderr,"-s\talso count system calls made by the daemon\n");
+    exit(1);
+}
+
+/* Start the daemon replaying the trace, with its standard output and error
+   redirected to the specified descriptors (or left alone if -1), and traced
+   if asked. */
+static pid_t startDaemon( char **args, int out, int err, bool traced )
+{
+    pid_t pid = fork();
+    if( pid != 0 )
+	return( pid );
+    if( out >= 0 )
+	dup2(out,1);
+    if( err >= 0 )
+	dup2(err,2);
+    if( allocCounter != NULL )
+	setenv("LD_PRELOAD",allocCounter,1);
+    if( traced )
+	ptrace(PTRACE_TRACEME,0,NULL,NULL);
+    execvp(args[0],args);
+    perror(args[0]);
+    _exit(127);
+}
+
+/* Wait for the daemon to finish, and return true if it succeeded. */
+static bool waitForDaemon( pid_t pid )
+{
+    int status;
+    if( waitpid(pid,&status,0) < 0 )
+	return( false );
+    return( WIFEXITED(status) && WEXITSTATUS(status) == 0 );
+}
+
+/* Replay the trace, copying the daemon's output to ours or comparing it with
+   the expected output. Returns false if the replay failed or the output
+   differed. */
+static bool replay( char **args, const char *expectedPath )
+{
+    FILE *expected = NULL;
+    if( expectedPath != NULL && (expected = fopen(expectedPath,"r")) == NULL ) {
+	perror(expectedPath);
+	return( false );
+    }
+
+    int fds[2];
+    if( pipe(fds) < 0 )
+	return( false );
+    pid_t pid = startDaemon(args,fds[1],-1,false);
+    close(fds[1]);
+    FILE *output = fdopen(fds[0],"r");
+    if( pid < 0 || output == NULL )
+	return( false );
+
+    char line[256], want[256];
+    int lineNum = 0, differs = 0;
+    while( fgets(line,sizeof(line),output) != NULL ) {
+	++lineNum;
+	if( expected == NULL )
+	    fputs(line,stdout);
+	else if( differs == 0 ) {
+	    if( fgets(want,sizeof(want),expected) == NULL )
+		strcpy(want,"(end of output)\n");
+	    if( strcmp(line,want) != 0 ) {
+		differs = lineNum;
+		printf("output differs at line %d\n< %s> %s",lineNum,want,line);
+	    }
+	}
+    }
+    fclose(output);
+    bool ok = waitForDaemon(pid);
+    if( !ok )
+	fprintf(stderr,"pitabreplay: %s failed\n",args[0]);
+
+    if( expected != NULL ) {
+	if( differs == 0 && fgets(want,sizeof(want),expected) != NULL ) {
+	    differs = lineNum + 1;
+	    printf("output differs at line %d\n< %s> (end of output)\n",
+		   differs,want);
+	}
+	if( differs == 0 )
+	    printf("output matches %s (%d lines)\n",expectedPath,lineNum);
+	fclose(expected);
+    }
+    return( ok && differs == 0 );
+}
+
+/* Replay the trace again under ptrace, counting the system calls the daemon
+   makes (including those made while starting up), and the number of passes
+   through its scheduling loop that it reports. */
+static bool countSystemCalls( char **args, uint64_t *calls, uint64_t *cycles )
+{
+    int fds[2], null = open("/dev/null",O_WRONLY);
+    if( null < 0 || pipe(fds) < 0 )
+	return( false );
+    pid_t pid = startDaemon(args,null,fds[1],true);
+    close(fds[1]);
+    close(null);
+    if( pid < 0 )
+	return( false );
+
+    /* The daemon stops when it starts executing, and then at the entry to
+       and exit from every system call, except that exiting never returns. */
+    int status;
+    if( waitpid(pid,&status,0) < 0 || !WIFSTOPPED(status) )
+	return( false );
+    ptrace(PTRACE_SETOPTIONS,pid,NULL,
+	   (void *) (PTRACE_O_TRACESYSGOOD | PTRACE_O_EXITKILL));
+    uint64_t stops = 0;
+    int sig = 0;
+    for( ;; ) {
+	ptrace(PTRACE_SYSCALL,pid,NULL,(void *) (intptr_t) sig);
+	if( waitpid(pid,&status,0) < 0 || !WIFSTOPPED(status) )
+	    break;
+	sig = 0;
+	if( WSTOPSIG(status) == (SIGTRAP | 0x80) )
+	    ++stops;
+	else
+	    sig = WSTOPSIG(status);
+    }
+    *calls = (stops + 1) / 2;
+
+    /* Find the cycle count in what the daemon reported. */
+    FILE *report = fdopen(fds[0],"r");
+    char line[256];
+    unsigned long long n;
+    *cycles = 0;
+    while( report != NULL && fgets(line,sizeof(line),report) != NULL )
+	if( sscanf(line,"cycles %llu",&n) == 1 )
+	    *cycles = n;
+    if( report != NULL )
+	fclose(report);
+    return( WIFEXITED(status) && WEXITSTATUS(status) == 0 );
+}
+
+int main( int argc, char **argv )
+{
+    bool optSystemCalls = false;
+    char *daemon = "./pitabd";
+    int c;
+    while( (c = getopt(argc,argv,"a:d:s")) != -1 ) {
+	switch( c ) {
+	case 'a':
+	    allocCounter = optarg;
+	    break;
+	case 'd':
+	    daemon = optarg;
+	    break;
+	case 's':
+	    optSystemCalls = true;
+	    break;
+	default:
+	    usage();
+	}
+    }
+    if( optind != argc - 1 && optind != argc - 2 )
+	usage();
+
+    if( access(allocCounter,R_OK) != 0 ) {
+	fprintf(stderr,"pitabreplay: %s not found, so allocations won't be "
+		"counted\n",allocCounter);
+	allocCounter = NULL;
+    }
+
+    char *args[] = { daemon, "-t", argv[optind], NULL };
+    bool ok = replay(args,argv[optind+1]);
+
+    uint64_t calls, cycles;
+    if( ok && optSystemCalls ) {
+	if( !countSystemCalls(args,&calls,&cycles) || cycles == 0 ) {
+	    fprintf(stderr,"pitabreplay: unable to count system calls\n");
+	    return( 1 );
+	}
+	fprintf(stderr,"system calls %llu (%.6f per cycle)\n",
+		(unsigned long long) calls,(double) calls / cycles);
+    }
+    return( ok ? 0 : 1 );
+}
@@ -0,0 +1,284 @@
+/* PiTabDaemon - CPU Power Profiles */
+
+/* Copyright (c) 2017 by Stefan Vorkoetter
+
+   This file is part of PiTabDaemon.
+
+   PiTabDaemon is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   PiTabDaemon is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with PiTabDaemon. If not, see <http://www.gnu.org/licenses/>. */
+
+#define _GNU_SOURCE
+
+#include <dirent.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "power.h"
+#include "replay.h"
+
+/* Each profile sets the frequency governor and the highest frequency allowed
+   on every cpufreq policy (cluster of CPUs sharing a clock), and how many
+   CPUs are online. CPU 0 can't be taken offline. Unless it is configured,
+   the normal profile is whatever the CPUs were set to before the first
+   profile was applied. When replaying a trace, the profile is reported
+   instead of being applied. */
+
+#define POWER_ROOT "/sys/devices/system/cpu"
+#define MAX_GOVERNOR 32
+
+struct Profile {
+    const char *name;
+    char governor[MAX_GOVERNOR];
+    long maxFreq;	/* kHz, or 0 for the hardware maximum. */
+    int cpus;		/* CPUs online, or 0 for all. */
+};
+
+static struct Profile profiles[NUM_POWER_PROFILES] = {
+    { "normal", "ondemand", 0, 0 },
+    { "saving", "powersave", 0, 0 },
+    { "dim", "powersave", 0, 0 },
+    { "dark", "powersave", 0, 0 }
+};
+
+static const char *root = POWER_ROOT;
+static bool normalKnown = false;
+
+/* The profile in effect (or -1 before the first is applied), since when,
+   and the time spent in each one before that. */
+static int current = -1;
+static int64_t since;
+static int64_t timeSpent[NUM_POWER_PROFILES];
+
+bool ConfigurePowerProfile( const char *spec )
+{
+    const char *equals = strchr(spec,'=');
+    if( equals == NULL )
+	return( false );
+    for( int i = 0; i < NUM_POWER_PROFILES; ++i ) {
+	struct Profile *p = &profiles[i];
+	if( strlen(p->name) != (size_t) (equals - spec)
+	 || strncmp(p->name,spec,equals - spec) != 0 )
+	    continue;
+
+	char governor[MAX_GOVERNOR];
+	long maxFreq = 0;
+	int cpus = 0;
+	if( sscanf(equals + 1,"%31[^,],%ld,%d",governor,&maxFreq,&cpus) < 1
+	 || maxFreq < 0 || cpus < 0 )
+	    return( false );
+	strcpy(p->governor,governor);
+	p->maxFreq = maxFreq;
+	p->cpus = cpus;
+	normalKnown = normalKnown || i == POWER_NORMAL;
+	return( true );
+    }
+    return( false );
+}
+
+void SetPowerRoot( const char *path )
+{
+    root = path;
+}
+
+/* Open a setting in a subdirectory of the root (dir/name/file), returning
+   NULL if it can't be opened. */
+static FILE *openSetting( const char *dir, const char *name, const char *file,
+			  const char *mode )
+{
+    char path[512];
+    if( snprintf(path,sizeof(path),"%s/%s/%s/%s",root,dir,name,file)
+	>= (int) sizeof(path) )
+	return( NULL );
+    return( fopen(path,mode) );
+}
+
+/* Read a setting as a word, returning false if it can't be read. */
+static bool readSetting( const char *dir, const char *name, const char *file,
+			 char *value, size_t size )
+{
+    char format[16];
+    snprintf(format,sizeof(format),"%%%zus",size - 1);
+    FILE *fp = openSetting(dir,name,file,"r");
+    if( fp == NULL )
+	return( false );
+    bool ok = fscanf(fp,format,value) == 1;
+    fclose(fp);
+    return( ok );
+}
+
+/* Write a setting, returning false if it can't be written. */
+static bool writeSetting( const char *dir, const char *name, const char *file,
+			  const char *value )
+{
+    FILE *fp = openSetting(dir,name,file,"w");
+    if( fp == NULL )
+	return( false );
+    bool ok = fprintf(fp,"%s\n",value) > 0;
+    return( fclose(fp) == 0 && ok );
+}
+
+/* Bring CPUs online (or take them offline) according to a profile. Only
+   those whose state must change are touched. */
+static bool setCPUsOnline( const struct Profile *p, bool online )
+{
+    DIR *dir = opendir(root);
+    if( dir == NULL )
+	return( false );
+
+    bool ok = true;
+    struct dirent *entry;
+    while( (entry = readdir(dir)) != NULL ) {
+	char *end;
+	if( strncmp(entry->d_name,"cpu",3) != 0 )
+	    continue;
+	long cpu = strtol(entry->d_name + 3,&end,10);
+	if( end == entry->d_name + 3 || *end != '\0' || cpu == 0 )
+	    continue;
+	bool wanted = p->cpus == 0 || cpu < p->cpus;
+	if( wanted == online )
+	    ok = writeSetting(".",entry->d_name,"online",online ? "1" : "0")
+	      && ok;
+    }
+    closedir(dir);
+    return( ok );
+}
+
+/* Set the governor and maximum frequency of every cpufreq policy. */
+static bool setFrequencies( const struct Profile *p )
+{
+    char path[512];
+    snprintf(path,sizeof(path),"%s/cpufreq",root);
+    DIR *dir = opendir(path);
+    if( dir == NULL )
+	return( false );
+
+    bool ok = true;
+    struct dirent *entry;
+    while( (entry = readdir(dir)) != NULL ) {
+	if( strncmp(entry->d_name,"policy",6) != 0 )
+	    continue;
+
+	/* The hardware maximum is read from the policy itself. */
+	char freq[32] = "";
+	if( p->maxFreq > 0 )
+	    snprintf(freq,sizeof(freq),"%ld",p->maxFreq);
+	else if( !readSetting("cpufreq",entry->d_name,"cpuinfo_max_freq",freq,
+			      sizeof(freq)) )
+	    freq[0] = '\0';
+	ok = freq[0] != '\0'
+	  && writeSetting("cpufreq",entry->d_name,"scaling_max_freq",freq) && ok;
+	ok = writeSetting("cpufreq",entry->d_name,"scaling_governor",p->governor)
+	  && ok;
+    }
+    closedir(dir);
+    return( ok );
+}
+
+/* Take the normal profile from the CPUs' current settings: the governor of
+   the first cpufreq policy, the first maximum frequency below the hardware's
+   (if any), and the number of CPUs online (if not all). */
+static void readNormalProfile( void )
+{
+    struct Profile *p = &profiles[POWER_NORMAL];
+    char path[512];
+    snprintf(path,sizeof(path),"%s/cpufreq",root);
+    DIR *dir = opendir(path);
+    if( dir == NULL )
+	return;
+
+    bool gotGovernor = false;
+    struct dirent *entry;
+    while( (entry = readdir(dir)) != NULL ) {
+	if( strncmp(entry->d_name,"policy",6) != 0 )
+	    continue;
+	char governor[MAX_GOVERNOR], freq[32], maxFreq[32];
+	if( !gotGovernor
+	 && readSetting("cpufreq",entry->d_name,"scaling_governor",governor,
+			sizeof(governor)) ) {
+	    strcpy(p->governor,governor);
+	    gotGovernor = true;
+	}
+	if( p->maxFreq == 0
+	 && readSetting("cpufreq",entry->d_name,"scaling_max_freq",freq,
+			sizeof(freq))
+	 && readSetting("cpufreq",entry->d_name,"cpuinfo_max_freq",maxFreq,
+			sizeof(maxFreq))
+	 && atol(freq) < atol(maxFreq) )
+	    p->maxFreq = atol(freq);
+    }
+    closedir(dir);
+
+    /* CPU 0 has no online setting when it can't be taken offline. */
+    if( (dir = opendir(root)) == NULL )
+	return;
+    int cpus = 0, online = 0;
+    while( (entry = readdir(dir)) != NULL ) {
+	char *end, state[4];
+	if( strncmp(entry->d_name,"cpu",3) != 0 )
+	    continue;
+	strtol(entry->d_name + 3,&end,10);
+	if( end == entry->d_name + 3 || *end != '\0' )
+	    continue;
+	++cpus;
+	if( !readSetting(".",entry->d_name,"online",state,sizeof(state))
+	 || strcmp(state,"0") != 0 )
+	    ++online;
+    }
+    closedir(dir);
+    if( online < cpus )
+	p->cpus = online;
+}
+
+bool SetPowerProfile( int profile, int64_t now )
+{
+    if( profile == current )
+	return( true );
+
+    const struct Profile *p = &profiles[profile];
+    bool ok = true;
+    if( Replaying() )
+	ReplayOutput("power profile %s",p->name);
+    else {
+	if( !normalKnown ) {
+	    readNormalProfile();
+	    normalKnown = true;
+	}
+	ok = setCPUsOnline(p,true);
+	ok = setFrequencies(p) && ok;
+	ok = setCPUsOnline(p,false) && ok;
+    }
+
+    /* Time spent in a profile that couldn't be fully applied still counts
+       towards the previous one, and the profile is applied again next
+       time. */
+    if( ok ) {
+	if( current >= 0 )
+	    timeSpent[current] += now - since;
+	current = profile;
+	since = now;
+    }
+    return( ok );
+}
+
+const char *GetPowerProfileName( int profile )
+{
+    return( profiles[profile].name );
+}
+
+int64_t GetPowerProfileTime( int profile, int64_t now )
+{
+    return( timeSpent[profile] + (profile == current ? now - since : 0) );
+}
@@ -0,0 +1,50 @@
+/* PiTabDaemon - CPU Power Profiles */
+
+/* Copyright (c) 2017 by Stefan Vorkoetter
+
+   This file is part of PiTabDaemon.
+
+   PiTabDaemon is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   PiTabDaemon is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with PiTabDaemon. If not, see <http://www.gnu.org/licenses/>. */
+
+#ifndef __PI_TAB_DAEMON_POWER_H__
+#define __PI_TAB_DAEMON_POWER_H__
+
+/* Power profiles: the CPUs' settings for normal use, for saving power when
+   the battery is low (see shed.h), and for when the display is dimmed or
+   dark because the tablet is idle. */
+enum { POWER_NORMAL, POWER_SAVING, POWER_DIM, POWER_DARK, NUM_POWER_PROFILES };
+
+/* Configure a profile from a specification of the form
+   "name=governor[,max[,cpus]]", where name is normal, saving, dim, or dark,
+   max is the highest frequency allowed in kHz (or 0 for the hardware's
+   maximum), and cpus is the number of CPUs to keep online (or 0 for all).
+   Returns false if the specification isn't valid. */
+extern bool ConfigurePowerProfile( const char *spec );
+
+/* Use a directory other than /sys/devices/system/cpu, such as a fake tree
+   for testing. */
+extern void SetPowerRoot( const char *path );
+
+/* Switch to a profile, if it isn't already in effect, bringing any CPUs it
+   needs online before changing the frequency settings, and taking any it
+   doesn't need offline afterwards. Returns false if any setting couldn't be
+   changed, in which case the profile isn't considered to be in effect. */
+extern bool SetPowerProfile( int profile, int64_t now );
+
+/* Return the name of a profile, and the time in ms that has been spent in
+   it. */
+extern const char *GetPowerProfileName( int profile );
+extern int64_t GetPowerProfileTime( int profile, int64_t now );
+
+#endif
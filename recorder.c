@@ -0,0 +1,93 @@
+/* PiTabDaemon - Flight Recorder */
+
+/* Copyright (c) 2017 by Stefan Vorkoetter
+
+   This file is part of PiTabDaemon.
+
+   PiTabDaemon is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   PiTabDaemon is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with PiTabDaemon. If not, see <http://www.gnu.org/licenses/>. */
+
+#define _GNU_SOURCE
+
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include "recorder.h"
+
+static struct RecorderHeader *header = NULL;
+static struct Record *records;
+
+static uint64_t microseconds( clockid_t clock )
+{
+    struct timespec ts;
+    clock_gettime(clock,&ts);
+    return( (uint64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000 );
+}
+
+bool InitRecorder( const char *path )
+{
+    size_t size = sizeof(struct RecorderHeader)
+		+ RECORDER_RECORDS * sizeof(struct Record);
+    int fd = open(path,O_RDWR | O_CREAT | O_CLOEXEC,0644);
+    if( fd < 0 )
+	return( false );
+    if( ftruncate(fd,size) < 0 ) {
+	close(fd);
+	return( false );
+    }
+    void *p = mmap(NULL,size,PROT_READ | PROT_WRITE,MAP_SHARED,fd,0);
+    close(fd);
+    if( p == MAP_FAILED )
+	return( false );
+    header = p;
+    records = (struct Record *) (header + 1);
+
+    /* Start afresh unless there's a compatible ring to add to. */
+    if( header->magic != RECORDER_MAGIC
+     || header->version != RECORDER_VERSION
+     || header->recordSize != sizeof(struct Record)
+     || header->numRecords != RECORDER_RECORDS ) {
+	memset(p,0,size);
+	header->magic = RECORDER_MAGIC;
+	header->version = RECORDER_VERSION;
+	header->recordSize = sizeof(struct Record);
+	header->numRecords = RECORDER_RECORDS;
+    }
+    header->monotonicTime = microseconds(CLOCK_MONOTONIC);
+    header->realTime = microseconds(CLOCK_REALTIME);
+
+    Record(REC_START,0,getpid(),0);
+    return( true );
+}
+
+void Record( int type, int arg, double value0, double value1 )
+{
+    if( header == NULL )
+	return;
+
+    uint64_t n = __atomic_fetch_add(&header->count,1,__ATOMIC_RELAXED);
+    struct Record *rec = &records[n % RECORDER_RECORDS];
+    __atomic_store_n(&rec->sequence,0,__ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    rec->type = type;
+    rec->arg = arg;
+    rec->time = microseconds(CLOCK_MONOTONIC);
+    rec->value[0] = value0;
+    rec->value[1] = value1;
+    __atomic_store_n(&rec->sequence,(uint32_t) (n + 1),__ATOMIC_RELEASE);
+}
@@ -0,0 +1,65 @@
+/* PiTabDaemon - Flight Recorder */
+
+/* Copyright (c) 2017 by Stefan Vorkoetter
+
+   This file is part of PiTabDaemon.
+
+   PiTabDaemon is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   PiTabDaemon is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with PiTabDaemon. If not, see <http://www.gnu.org/licenses/>. */
+
+#ifndef __PI_TAB_DAEMON_RECORDER_H__
+#define __PI_TAB_DAEMON_RECORDER_H__
+
+#include <stdint.h>
+
+/* The flight recorder keeps the most recent RECORDER_RECORDS records of what
+   the daemon saw (battery readings, input changes, and display changes) in a
+   ring in a memory mapped file on the RAM disk. Since the kernel owns the
+   file's pages, whatever was recorded survives the daemon crashing, and can
+   be examined afterwards with pitabrec. Each record's sequence number is set
+   last, so a record that was only partly written when the daemon died can be
+   recognized. */
+#define RECORDER_FILE		"/ram/pitabd.rec"
+#define RECORDER_MAGIC		0x50544652
+#define RECORDER_VERSION	1
+#define RECORDER_RECORDS	16384
+
+/* Record types, and what their arg and values are. */
+#define REC_START	1	/* Process id. */
+#define REC_BATTERY	2	/* Charging, rAct, rAdj. */
+#define REC_INPUT	3	/* Input number, new state (1 or -1). */
+#define REC_DISPLAY	4	/* Display state, brightness index. */
+
+struct Record {
+    uint32_t sequence;		/* Position in the ring, plus one. */
+    uint16_t type;
+    uint16_t arg;
+    uint64_t time;		/* Microseconds on the monotonic clock. */
+    float value[2];
+};
+
+struct RecorderHeader {
+    uint32_t magic, version;
+    uint32_t recordSize, numRecords;
+    uint64_t count;		/* Number of records ever written. */
+    uint64_t monotonicTime;	/* The same moment on the monotonic clock */
+    int64_t realTime;		/* and in microseconds since the epoch. */
+};
+
+/* Start recording, carrying on from what a previous instance recorded. */
+extern bool InitRecorder( const char *path );
+
+/* Add a record, if recording. */
+extern void Record( int type, int arg, double value0, double value1 );
+
+#endif
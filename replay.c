@@ -0,0 +1,236 @@
+/* PiTabDaemon - Trace Replay */
+
+/* Copyright (c) 2017 by Stefan Vorkoetter
+
+   This file is part of PiTabDaemon.
+
+   PiTabDaemon is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   PiTabDaemon is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with PiTabDaemon. If not, see <http://www.gnu.org/licenses/>. */
+
+#define _GNU_SOURCE
+
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "activity.h"
+#include "io.h"
+#include "replay.h"
+#include "sched.h"
+
+/* A trace is a text file of changes to the daemon's inputs, one per line,
+   giving the time in ms from the start of the trace, what changed, and its
+   new value. For example:
+
+	0	switch	1
+	0	battery	0.55
+	2000	button1	1
+	2080	button1	0
+	60000	end
+
+   The inputs are named as in TRACE_NAMES below, and are 1 when active,
+   whether their pins are active high or low. The battery value is the duty
+   cycle of the battery monitor input, "touch" is activity on the
+   touchscreen or another input device, and "end" only marks the end of the
+   trace. Lines must be in time order, and blank lines and lines starting
+   with # are ignored. pitabrec -t turns a flight recording into a trace.
+
+   While a trace is replayed, the scheduler runs on a virtual clock that
+   jumps straight to each deadline instead of waiting for it, so hours of
+   trace take seconds to replay. Whatever the daemon does to the hardware
+   (the backlight, windows, USB, Wi-Fi, the CPU governor) and whatever it
+   logs is written to standard output, along with the virtual time, in
+   place of doing it. The same trace always produces the same output, so
+   the output of a changed daemon can be compared with that of the old one
+   (which pitabreplay does). */
+
+enum { TRACE_BATTERY = CHARGED + 1, TRACE_TOUCH, TRACE_END, NUM_TRACE_NAMES };
+
+static const char *TRACE_NAMES[NUM_TRACE_NAMES] = {
+    "switch", "button1", "button2", "button3", "lowbatt", "charging",
+    "charged", "battery", "touch", "end"
+};
+
+struct TraceEvent {
+    int64_t time;
+    int what;
+    double value;
+};
+
+static struct TraceEvent *events = NULL;
+static int numEvents, nextEvent;
+
+/* State of the inputs as of the last event replayed. The battery monitor's
+   samples are spread as evenly as possible to give its duty cycle, which
+   is close enough to sampling the comparator's real output at random
+   times. */
+static uint32_t inputs;
+static double duty, dither;
+
+/* Wall clock time taken by the replay, and the number of memory allocations
+   made before replaying started. */
+static struct timespec started;
+static uint64_t startAllocations;
+
+/* Return the number of memory allocations made so far. This is only defined
+   when pitaballoc.so has been preloaded (as pitabreplay does), since
+   counting them means wrapping every allocation. */
+extern uint64_t CountedAllocations( void ) __attribute__((weak));
+
+bool StartReplay( const char *path )
+{
+    FILE *fp = fopen(path,"r");
+    if( fp == NULL )
+	return( false );
+
+    char line[128];
+    int size = 0, lineNum = 0;
+    bool ok = true;
+    while( ok && fgets(line,sizeof(line),fp) != NULL ) {
+	++lineNum;
+	long long time;
+	char name[16];
+	double value = 0;
+	int n = sscanf(line,"%lld %15s %lf",&time,name,&value);
+	if( n <= 0 || line[0] == '#' )
+	    continue;
+
+	int what = 0;
+	while( what < NUM_TRACE_NAMES && strcmp(name,TRACE_NAMES[what]) != 0 )
+	    ++what;
+	if( n < 2 || what == NUM_TRACE_NAMES
+	 || n < 3 && what != TRACE_TOUCH && what != TRACE_END
+	 || numEvents > 0 && time < events[numEvents-1].time ) {
+	    fprintf(stderr,"%s:%d: invalid trace event\n",path,lineNum);
+	    ok = false;
+	    break;
+	}
+
+	if( numEvents == size ) {
+	    size = size > 0 ? size * 2 : 256;
+	    struct TraceEvent *p = realloc(events,size * sizeof(*events));
+	    if( p == NULL ) {
+		ok = false;
+		break;
+	    }
+	    events = p;
+	}
+	events[numEvents].time = time;
+	events[numEvents].what = what;
+	events[numEvents].value = value;
+	++numEvents;
+    }
+    fclose(fp);
+    if( !ok || numEvents == 0 ) {
+	free(events);
+	events = NULL;
+	return( false );
+    }
+
+    /* The user is taken to be present when the trace starts. */
+    UseVirtualClock();
+    NoteActivity(0);
+
+    clock_gettime(CLOCK_MONOTONIC,&started);
+    startAllocations = CountedAllocations != NULL ? CountedAllocations() : 0;
+    return( true );
+}
+
+bool Replaying( void )
+{
+    return( events != NULL );
+}
+
+int64_t GetTraceEnd( void )
+{
+    return( numEvents > 0 ? events[numEvents-1].time : 0 );
+}
+
+/* Replay the events up to the current virtual time. */
+static void replayEvents( void )
+{
+    int64_t now = NowMs();
+    while( nextEvent < numEvents && events[nextEvent].time <= now ) {
+	const struct TraceEvent *event = &events[nextEvent++];
+	if( event->what <= CHARGED ) {
+	    if( event->value != 0 )
+		inputs |= 1U << event->what;
+	    else
+		inputs &= ~(1U << event->what);
+	}
+	else if( event->what == TRACE_BATTERY )
+	    duty = event->value;
+	else if( event->what == TRACE_TOUCH )
+	    NoteActivity(event->time);
+    }
+}
+
+uint32_t GetTraceInputs( void )
+{
+    replayEvents();
+    return( inputs );
+}
+
+bool GetTraceBatterySample( void )
+{
+    replayEvents();
+    dither += duty;
+    if( dither < 1 )
+	return( false );
+    dither -= 1;
+    return( true );
+}
+
+void ReplayOutput( const char *format, ... )
+{
+    int64_t now = NowMs();
+    printf("%lld.%03d ",(long long) (now / 1000),(int) (now % 1000));
+
+    va_list args;
+    va_start(args,format);
+    vprintf(format,args);
+    va_end(args);
+    putchar('\n');
+}
+
+void FinishReplay( void )
+{
+    fflush(stdout);
+
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC,&now);
+    double seconds = (now.tv_sec - started.tv_sec)
+		   + (now.tv_nsec - started.tv_nsec) / 1e9;
+
+    /* The cycle count is also read by pitabreplay, so keep it on a line of
+       its own. */
+    struct SchedulerStats stats;
+    GetSchedulerStats(&stats);
+    fprintf(stderr,"replayed %.3fs of trace in %.3fs\n",NowMs() / 1000.0,
+	    seconds);
+    fprintf(stderr,"cycles %llu\n",(unsigned long long) stats.cycles);
+    fprintf(stderr,"cycles per second %.0f\n",
+	    seconds > 0 ? stats.cycles / seconds : 0);
+    if( CountedAllocations != NULL ) {
+	uint64_t allocated = CountedAllocations() - startAllocations;
+	fprintf(stderr,"allocations %llu (%.6f per cycle)\n",
+		(unsigned long long) allocated,
+		stats.cycles > 0 ? (double) allocated / stats.cycles : 0);
+    }
+    fprintf(stderr,"worst stall %lldus in %s\n",(long long) stats.worstStall,
+	    stats.worstStallCause != NULL ? stats.worstStallCause : "nothing");
+}
@@ -0,0 +1,46 @@
+/* PiTabDaemon - Trace Replay */
+
+/* Copyright (c) 2017 by Stefan Vorkoetter
+
+   This file is part of PiTabDaemon.
+
+   PiTabDaemon is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   PiTabDaemon is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with PiTabDaemon. If not, see <http://www.gnu.org/licenses/>. */
+
+#ifndef __PI_TAB_DAEMON_REPLAY_H__
+#define __PI_TAB_DAEMON_REPLAY_H__
+
+/* Load a trace of the daemon's inputs (see replay.c for its format) and
+   replay it on a virtual clock instead of running on the tablet's hardware.
+   Returns false if the trace can't be read. */
+extern bool StartReplay( const char *path );
+extern bool Replaying( void );
+
+/* Return the virtual time in ms at which the trace ends. */
+extern int64_t GetTraceEnd( void );
+
+/* Return the inputs that are active in the trace at the current virtual time
+   (bit i for input i, as numbered in io.h), and the next sample of the
+   battery monitor input. */
+extern uint32_t GetTraceInputs( void );
+extern bool GetTraceBatterySample( void );
+
+/* Write a line to standard output describing something the daemon did, such
+   as a change to the hardware, preceded by the virtual time. */
+extern void ReplayOutput( const char *format, ... )
+    __attribute__((format(printf,1,2)));
+
+/* Report how long the replay took and how much work it involved. */
+extern void FinishReplay( void );
+
+#endif
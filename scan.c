@@ -0,0 +1,555 @@
+/* PiTabDaemon - Input Scanning */
+
+/* Copyright (c) 2017 by Stefan Vorkoetter
+
+   This file is part of PiTabDaemon.
+
+   PiTabDaemon is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   PiTabDaemon is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with PiTabDaemon. If not, see <http://www.gnu.org/licenses/>. */
+
+#define _GNU_SOURCE
+
+#include <inttypes.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sched.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+
+#include "battery.h"
+#include "io.h"
+#include "scan.h"
+#include "sched.h"
+
+/* The inputs have to be scanned and the battery monitor sampled every
+   millisecond without fail, or button presses can be missed and battery
+   readings skewed. The main thread can't promise that, since it also does
+   everything that can take a while: window management through the X server,
+   sysfs writes, running lxpanelctl, and so on. So a thread of its own does
+   nothing but scan, on its own clock, and passes what it finds to the main
+   thread through a queue that neither thread ever has to wait for.
+
+   The queue is a ring with a single producer (the scan thread) and a single
+   consumer (the main thread). Each side only writes its own index, and
+   stores it with release ordering after filling or emptying a slot, so the
+   other side, loading it with acquire ordering, sees the slot's contents
+   as of that point. If the ring is full the event is counted and dropped
+   rather than waiting. The main thread is told there are events by an
+   eventfd, which it watches. Battery readings change slowly, so they are
+   only passed on every BATTERY_REPORT_INTERVAL ms, and only while the ring
+   is less than half full, so that they can't crowd out input changes. If
+   the battery estimator takes its own samples instead (see battery.h), the
+   battery is only sampled every so often, and each reading is passed on. A
+   burst of samples holds up scanning for 10 to 20ms, which isn't counted as
+   missed scans.
+
+   If the inputs come from the GPIO character device, the kernel debounces
+   them, so there's nothing to scan. The thread then sleeps until an input
+   changes or the battery is next due to be sampled, which is still every
+   millisecond unless the estimator takes its own samples, but otherwise only
+   a few times a second.
+
+   When a trace is being replayed (see replay.h), there is no scan thread,
+   and ScanInputs is run as a job on the virtual clock instead.
+
+   Real-Time Scanning
+
+   Even on its own, the scan thread can still be preempted by everything
+   else running on the tablet (a browser, say), delaying scans by many
+   milliseconds. If asked to, it runs under the SCHED_FIFO policy instead,
+   so that it preempts anything that isn't real-time, and can be pinned to
+   one CPU. The process's memory is then locked so that nothing the scanner
+   uses can be paged out. Pages are only locked as they are faulted in, so
+   that the other threads' large stacks aren't forced into memory, and the
+   scanner touches its own stack and the queue before it starts scanning,
+   so that they don't fault during a scan. */
+
+#define EVENT_SLOTS 256
+#define BATTERY_REPORT_INTERVAL 250
+
+/* Stack size of a real-time scan thread, and how much of it to touch before
+   scanning. */
+#define RT_STACK_SIZE (64 * 1024)
+#define RT_STACK_PREFAULT (32 * 1024)
+
+/* Priority used by the latency test if none has been set. */
+#define RT_TEST_PRIORITY 50
+
+static struct ScanEvent events[EVENT_SLOTS];
+static uint32_t head, tail;	/* Next slot to fill, and next to empty. */
+
+static int eventFd = -1, stopFd = -1;
+static pthread_t scanner;
+static bool scanning = false, stopping;
+static uint32_t missedScans, lostEvents;
+
+/* Number of times the scan thread has woken up, and when it started (in ns),
+   to show how often it actually wakes. */
+static uint32_t wakeUps;
+static int64_t startTime;
+
+/* Real-time priority (or 0 for ordinary scheduling) and CPU (or -1 for any)
+   of the scan thread, and whether it actually got them. */
+static int rtPriority = 0, rtCPU = -1;
+static bool realtime = false;
+
+/* Whether the charging input is active, which tells the battery readings
+   whether each sample was taken with the charger connected, the number
+   of scans until the readings are next passed on, when (in ms) the battery
+   is next to be sampled, and whether it was just sampled on a schedule of
+   its own. */
+static bool charging = false;
+static int untilReport = 0;
+static int64_t nextSample = 0;
+static bool ownSchedule = false;
+
+static void queueEvent( const struct ScanEvent *event )
+{
+    if( head - __atomic_load_n(&tail,__ATOMIC_ACQUIRE) >= EVENT_SLOTS ) {
+	__atomic_add_fetch(&lostEvents,1,__ATOMIC_RELAXED);
+	return;
+    }
+    events[head % EVENT_SLOTS] = *event;
+    __atomic_store_n(&head,head + 1,__ATOMIC_RELEASE);
+
+    if( eventFd >= 0 ) {
+	uint64_t one = 1;
+	write(eventFd,&one,sizeof(one));
+    }
+}
+
+bool GetScanEvent( struct ScanEvent *event )
+{
+    if( tail == __atomic_load_n(&head,__ATOMIC_ACQUIRE) )
+	return( false );
+    *event = events[tail % EVENT_SLOTS];
+    __atomic_store_n(&tail,tail + 1,__ATOMIC_RELEASE);
+    return( true );
+}
+
+/* Debounce the inputs and queue any changes. */
+static void queueChanges( int64_t now )
+{
+    uint32_t state, changes = GetAllInputs(&state);
+    charging = state >> CHARGING & 1;
+    for( int i = 0; changes != 0; ++i, changes >>= 1 ) {
+	int c;
+	if( changes & 1 && (c = GetInput(i)) != 0 ) {
+	    struct ScanEvent event = { SCAN_INPUT, now, i, c, 0, 0, false };
+	    queueEvent(&event);
+	}
+    }
+}
+
+/* Queue any input changes. If the inputs come from the GPIO character
+   device, pass on the changes from each event separately, so that a press
+   and release can't cancel out. Any changes that didn't come from events
+   (such as the initial state of the inputs) are picked up afterwards. */
+static void scanInputs( int64_t now )
+{
+    if( GetInputFd() >= 0 )
+	while( ReadInputEvent() )
+	    queueChanges(now);
+    queueChanges(now);
+}
+
+/* Sample the battery every scan, or when the estimator says to, and pass on
+   the readings every so often. */
+static void sampleBattery( int64_t now )
+{
+    ownSchedule = false;
+    if( now < nextSample )
+	return;
+    int delay = GetBatteryReadingDelay();
+    nextSample = now + delay;
+    ownSchedule = delay > 0;
+
+    double rAdj, rAct = GetRawBatteryReadings(charging,&rAdj);
+    if( (ownSchedule || --untilReport <= 0)
+     && head - __atomic_load_n(&tail,__ATOMIC_ACQUIRE) < EVENT_SLOTS / 2 ) {
+	struct ScanEvent event = {
+	    SCAN_BATTERY, now, 0, 0, rAct, rAdj, BatteryReadingsReady()
+	};
+	queueEvent(&event);
+	untilReport = BATTERY_REPORT_INTERVAL / SCAN_INTERVAL;
+    }
+}
+
+void ScanInputs( void )
+{
+    int64_t now = NowMs();
+    scanInputs(now);
+    sampleBattery(now);
+}
+
+static int64_t nowNs( void )
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC,&ts);
+    return( (int64_t) ts.tv_sec * 1000000000 + ts.tv_nsec );
+}
+
+/* Sleep until the specified time (ns on the monotonic clock). */
+static void sleepUntil( int64_t ns )
+{
+    struct timespec ts = { ns / 1000000000, ns % 1000000000 };
+    clock_nanosleep(CLOCK_MONOTONIC,TIMER_ABSTIME,&ts,NULL);
+}
+
+/* Touch the part of the stack a real-time thread will use, so that it's
+   already in (locked) memory. */
+static void __attribute__((noinline)) prefaultStack( void )
+{
+    char stack[RT_STACK_PREFAULT];
+    memset(stack,0,sizeof(stack));
+    __asm__ volatile( "" : : "r" (stack) : "memory" );
+}
+
+/* Lock all of the process's memory as it's faulted in. */
+static void lockMemory( void )
+{
+    mlockall(MCL_CURRENT | MCL_FUTURE | MCL_ONFAULT);
+}
+
+/* Start a thread, which is real-time and pinned to a CPU if asked for, and
+   if the priority and CPU have been set. */
+static bool startThread( pthread_t *thread, void *(*func)( void * ),
+			 bool rt, int priority )
+{
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    if( rt && priority > 0 ) {
+	struct sched_param param = { .sched_priority = priority };
+	pthread_attr_setinheritsched(&attr,PTHREAD_EXPLICIT_SCHED);
+	pthread_attr_setschedpolicy(&attr,SCHED_FIFO);
+	pthread_attr_setschedparam(&attr,&param);
+	pthread_attr_setstacksize(&attr,RT_STACK_SIZE);
+    }
+    if( rt && rtCPU >= 0 ) {
+	cpu_set_t cpus;
+	CPU_ZERO(&cpus);
+	CPU_SET(rtCPU,&cpus);
+	pthread_attr_setaffinity_np(&attr,sizeof(cpus),&cpus);
+    }
+
+    /* Signals are meant for the main thread, so other threads block them. */
+    sigset_t all, old;
+    sigfillset(&all);
+    pthread_sigmask(SIG_SETMASK,&all,&old);
+    bool started = pthread_create(thread,&attr,func,NULL) == 0;
+    pthread_sigmask(SIG_SETMASK,&old,NULL);
+    pthread_attr_destroy(&attr);
+    return( started );
+}
+
+/* Advance the time of the next scan (in ns) by SCAN_INTERVAL ms. If a whole
+   interval has been missed, skip the missed scans instead of bunching them
+   up. */
+static int64_t nextScan( int64_t next )
+{
+    const int64_t INTERVAL = SCAN_INTERVAL * 1000000LL;
+    next += INTERVAL;
+    int64_t behind = nowNs() - next;
+    if( behind >= INTERVAL ) {
+	__atomic_add_fetch(&missedScans,behind / INTERVAL,__ATOMIC_RELAXED);
+	next += behind / INTERVAL * INTERVAL;
+    }
+    return( next );
+}
+
+/* Scan every SCAN_INTERVAL ms, on the same schedule however long each scan
+   takes. */
+static void scanPeriodically( void )
+{
+    int64_t next = nowNs();
+    while( !__atomic_load_n(&stopping,__ATOMIC_ACQUIRE) ) {
+	ScanInputs();
+	next = nextScan(ownSchedule ? nowNs() : next);
+	sleepUntil(next);
+	__atomic_add_fetch(&wakeUps,1,__ATOMIC_RELAXED);
+    }
+}
+
+/* Wait for input events from the GPIO character device, sampling the battery
+   whenever it's due in between, until told to stop. */
+static void waitForInputs( void )
+{
+    struct pollfd fds[2] = {
+	{ .fd = GetInputFd(), .events = POLLIN },
+	{ .fd = stopFd, .events = POLLIN }
+    };
+    scanInputs(NowMs());
+    int64_t next = nowNs();
+    for( ;; ) {
+	int64_t now = nowNs();
+	if( now >= next ) {
+	    sampleBattery(NowMs());
+	    next = ownSchedule ? nextSample * 1000000 : nextScan(next);
+	    now = nowNs();
+	}
+
+	int64_t wait = next > now ? next - now : 0;
+	struct timespec timeout = { wait / 1000000000, wait % 1000000000 };
+	int ready = ppoll(fds,2,&timeout,NULL);
+	__atomic_add_fetch(&wakeUps,1,__ATOMIC_RELAXED);
+	if( ready > 0 ) {
+	    if( fds[1].revents != 0 )
+		break;
+	    if( fds[0].revents != 0 )
+		scanInputs(NowMs());
+	}
+    }
+}
+
+static void *scan( void *arg )
+{
+    if( realtime ) {
+	prefaultStack();
+	memset(events,0,sizeof(events));
+    }
+    if( GetInputFd() >= 0 )
+	waitForInputs();
+    else
+	scanPeriodically();
+    return( NULL );
+}
+
+void SetScanRealtime( int priority, int cpu )
+{
+    rtPriority = priority;
+    rtCPU = cpu;
+}
+
+bool StartScanThread( void )
+{
+    if( (eventFd = eventfd(0,EFD_NONBLOCK | EFD_CLOEXEC)) < 0
+     || (stopFd = eventfd(0,EFD_NONBLOCK | EFD_CLOEXEC)) < 0 )
+	return( false );
+
+    /* Fall back to ordinary scheduling if real-time scheduling isn't
+       allowed. */
+    __atomic_store_n(&stopping,false,__ATOMIC_RELAXED);
+    startTime = nowNs();
+    if( rtPriority > 0 || rtCPU >= 0 ) {
+	if( rtPriority > 0 )
+	    lockMemory();
+	realtime = rtPriority > 0;
+	scanning = startThread(&scanner,scan,true,rtPriority);
+    }
+    if( !scanning ) {
+	realtime = false;
+	scanning = startThread(&scanner,scan,false,0);
+    }
+    return( scanning );
+}
+
+bool IsScanRealtime( void )
+{
+    return( realtime );
+}
+
+/* The latency test: how many wake-ups to measure, the lateness of each (in
+   ns), and whether the busy threads should stop. */
+static int testWakeUps;
+static int64_t *lateness;
+static bool testDone;
+
+/* Keep a CPU busy until the test is done. */
+static void *busy( void *arg )
+{
+    while( !__atomic_load_n(&testDone,__ATOMIC_RELAXED) )
+	;
+    return( NULL );
+}
+
+/* Wake up every SCAN_INTERVAL ms, like the scan thread, noting how late each
+   wake-up is. */
+static void *measure( void *arg )
+{
+    const int64_t INTERVAL = SCAN_INTERVAL * 1000000LL;
+    prefaultStack();
+    int64_t next = nowNs();
+    for( int i = 0; i < testWakeUps; ++i ) {
+	next += INTERVAL;
+	sleepUntil(next);
+	lateness[i] = nowNs() - next;
+    }
+    return( NULL );
+}
+
+static int compareLateness( const void *a, const void *b )
+{
+    int64_t x = *(const int64_t *)a, y = *(const int64_t *)b;
+    return( (x > y) - (x < y) );
+}
+
+/* Measure wake-up lateness for a number of seconds and print its median,
+   99th percentile and worst case. */
+static bool measureLateness( const char *what, bool rt, int priority )
+{
+    pthread_t thread;
+    if( !startThread(&thread,measure,rt,priority) ) {
+	printf("%-10s unavailable\n",what);
+	return( false );
+    }
+    pthread_join(thread,NULL);
+    qsort(lateness,testWakeUps,sizeof(*lateness),compareLateness);
+    printf("%-10s p50 %6" PRId64 " us  p99 %6" PRId64 " us  max %6" PRId64
+	   " us\n",what,lateness[testWakeUps / 2] / 1000,
+	   lateness[testWakeUps * 99 / 100] / 1000,
+	   lateness[testWakeUps - 1] / 1000);
+    return( true );
+}
+
+bool TestScanLatency( int seconds )
+{
+    testWakeUps = seconds * 1000 / SCAN_INTERVAL;
+    lateness = malloc(testWakeUps * sizeof(*lateness));
+    if( lateness == NULL )
+	return( false );
+    memset(lateness,0,testWakeUps * sizeof(*lateness));
+
+    /* Load every CPU with an ordinary thread. */
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    pthread_t loaders[cpus > 0 ? cpus : 1];
+    int loading = 0;
+    __atomic_store_n(&testDone,false,__ATOMIC_RELAXED);
+    for( long i = 0; i < cpus; ++i )
+	if( startThread(&loaders[loading],busy,false,0) )
+	    ++loading;
+    printf("wake-up lateness over %d s, with %d CPUs busy\n",seconds,
+	   loading);
+
+    bool ok = measureLateness("ordinary",false,0);
+    int priority = rtPriority > 0 ? rtPriority : RT_TEST_PRIORITY;
+    lockMemory();
+    ok = measureLateness("real-time",true,priority) && ok;
+
+    __atomic_store_n(&testDone,true,__ATOMIC_RELAXED);
+    for( int i = 0; i < loading; ++i )
+	pthread_join(loaders[i],NULL);
+    free(lateness);
+    return( ok );
+}
+
+void StopScanThread( void )
+{
+    if( scanning ) {
+	uint64_t one = 1;
+	__atomic_store_n(&stopping,true,__ATOMIC_RELEASE);
+	write(stopFd,&one,sizeof(one));
+	pthread_join(scanner,NULL);
+	scanning = false;
+    }
+}
+
+int GetScanFd( void )
+{
+    return( eventFd );
+}
+
+void ClearScanFd( void )
+{
+    uint64_t count;
+    if( eventFd >= 0 )
+	read(eventFd,&count,sizeof(count));
+}
+
+uint32_t GetMissedScans( void )
+{
+    return( __atomic_load_n(&missedScans,__ATOMIC_RELAXED) );
+}
+
+uint32_t GetLostScanEvents( void )
+{
+    return( __atomic_load_n(&lostEvents,__ATOMIC_RELAXED) );
+}
+
+double GetScanWakeUpRate( void )
+{
+    int64_t elapsed = nowNs() - startTime;
+    if( !scanning || elapsed <= 0 )
+	return( 0 );
+    return( __atomic_load_n(&wakeUps,__ATOMIC_RELAXED) * 1e9 / elapsed );
+}
+
+/* The queue is checked by having a thread queue a long series of events as
+   fast as it can (waiting whenever the queue is full, so none should be
+   dropped), while this thread takes them out as fast as it can. Every field
+   of event n is derived from n, so an event that was taken out before it
+   was completely filled in shows up as fields that don't agree, and a lost
+   or reordered event shows up as a gap in n. */
+
+#define CHECK_EVENTS 2000000
+
+static void makeCheckEvent( struct ScanEvent *event, int n )
+{
+    event->type = n & 1;
+    event->time = n;
+    event->input = -n;
+    event->change = n ^ 0x5555;
+    event->rAct = n / 2.0;
+    event->rAdj = -n;
+    event->ready = n % 3 == 0;
+}
+
+static void *produceCheckEvents( void *arg )
+{
+    struct ScanEvent event;
+    for( int n = 0; n < CHECK_EVENTS; ++n ) {
+	makeCheckEvent(&event,n);
+	while( head - __atomic_load_n(&tail,__ATOMIC_ACQUIRE) >= EVENT_SLOTS )
+	    sched_yield();
+	queueEvent(&event);
+    }
+    return( NULL );
+}
+
+bool CheckScanQueue( void )
+{
+    pthread_t producer;
+    uint32_t lost = GetLostScanEvents();
+    if( scanning || !startThread(&producer,produceCheckEvents,false,0) )
+	return( false );
+
+    long torn = 0, outOfOrder = 0;
+    int n = 0;
+    while( n < CHECK_EVENTS ) {
+	struct ScanEvent event, expected;
+	if( !GetScanEvent(&event) ) {
+	    sched_yield();
+	    continue;
+	}
+	makeCheckEvent(&expected,event.time);
+	if( event.type != expected.type || event.input != expected.input
+	 || event.change != expected.change || event.rAct != expected.rAct
+	 || event.rAdj != expected.rAdj || event.ready != expected.ready )
+	    ++torn;
+	else if( event.time != n )
+	    ++outOfOrder;
+	n = event.time + 1;
+    }
+    pthread_join(producer,NULL);
+    lost = GetLostScanEvents() - lost;
+    printf("scan queue: %d events, %ld torn, %ld lost or out of order, %u "
+	   "dropped\n",CHECK_EVENTS,torn,outOfOrder,lost);
+    return( torn == 0 && outOfOrder == 0 && lost == 0 );
+}
@@ -0,0 +1,87 @@
+/* PiTabDaemon - Input Scanning */
+
+/* Copyright (c) 2017 by Stefan Vorkoetter
+
+   This file is part of PiTabDaemon.
+
+   PiTabDaemon is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   PiTabDaemon is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with PiTabDaemon. If not, see <http://www.gnu.org/licenses/>. */
+
+#ifndef __PI_TAB_DAEMON_SCAN_H__
+#define __PI_TAB_DAEMON_SCAN_H__
+
+/* What the scanner found: a debounced change to one of the inputs, or fresh
+   readings of the battery monitor. */
+enum { SCAN_INPUT, SCAN_BATTERY };
+
+struct ScanEvent {
+    int type;
+    int64_t time;	/* When it was found (see NowMs). */
+    int input;		/* Input number (see io.h), */
+    int change;		/* and 1 if it became active, -1 if inactive. */
+    double rAct, rAdj;	/* Raw battery readings (see battery.h), */
+    bool ready;		/* and whether they're accurate enough to use. */
+};
+
+/* Scan and debounce the inputs and sample the battery monitor once, queuing
+   events for what was found. The scan thread does this every SCAN_INTERVAL
+   ms, unless the inputs come from the GPIO character device, in which case
+   it only reads the inputs when they change, and samples the battery every
+   SCAN_INTERVAL ms or whenever the estimator asks to be. */
+#define SCAN_INTERVAL 1
+
+extern void ScanInputs( void );
+
+/* Start or stop the thread that scans the inputs. Nothing else may use the
+   inputs or battery readings directly while it is running. */
+extern bool StartScanThread( void );
+extern void StopScanThread( void );
+
+/* Have the scan thread run under the real-time SCHED_FIFO policy at a
+   priority (1-99, or 0 for ordinary scheduling), with memory locked, and/or
+   pinned to a CPU (or -1 for any). This must be set before the thread is
+   started. If it can't be done, the thread is started normally, and
+   IsScanRealtime returns false. */
+extern void SetScanRealtime( int priority, int cpu );
+extern bool IsScanRealtime( void );
+
+/* Measure how late a thread waking every SCAN_INTERVAL ms is, for a number
+   of seconds with all CPUs busy, with ordinary scheduling and then real-time
+   scheduling (at the priority and on the CPU set by SetScanRealtime), and
+   print the results. Return false if either couldn't be measured. */
+extern bool TestScanLatency( int seconds );
+
+/* Return a descriptor that becomes readable when there are events in the
+   queue, clear it (before taking the events out, so none are missed), and
+   take the next event out of the queue, returning false if there are no
+   more. */
+extern int GetScanFd( void );
+extern void ClearScanFd( void );
+extern bool GetScanEvent( struct ScanEvent *event );
+
+/* Return the number of scans that were skipped because the thread fell
+   behind, and the number of events lost because the queue was full. */
+extern uint32_t GetMissedScans( void );
+extern uint32_t GetLostScanEvents( void );
+
+/* Return how many times a second the scan thread has woken up on average
+   since it started, or 0 if it isn't running. */
+extern double GetScanWakeUpRate( void );
+
+/* Check that events pass through the queue intact, in order, and without
+   being lost, while another thread is queuing them as fast as it can, and
+   print the result. This must be done while the scan thread isn't running.
+   Returns false if the check fails. */
+extern bool CheckScanQueue( void );
+
+#endif
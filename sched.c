@@ -0,0 +1,274 @@
+/* PiTabDaemon - Event Scheduling */
+
+/* Copyright (c) 2017 by Stefan Vorkoetter
+
+   This file is part of PiTabDaemon.
+
+   PiTabDaemon is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   PiTabDaemon is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with PiTabDaemon. If not, see <http://www.gnu.org/licenses/>. */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+
+#include "sched.h"
+
+/* Every periodic or one-shot activity of the daemon is a job with its own
+   deadline on the monotonic clock. Rather than waking up at a fixed rate and
+   counting cycles, the scheduler arms a single timerfd for the earliest
+   deadline and sleeps in epoll_wait until then, so the CPU is only woken when
+   there is actually something to do. Periodic jobs advance their deadline by
+   their period, not relative to when they actually ran, so they don't drift.
+   Activities driven by events rather than time, such as input changes, are
+   watches on file descriptors that epoll_wait also waits on.
+
+   Since everything the daemon does is timed by this loop, it keeps track of
+   how well it's keeping up: how late each job starts relative to its
+   deadline, how long each job or watch function runs (during which nothing
+   else can run), the longest of those stalls and what caused it, and how
+   many times a periodic job fell so far behind that runs had to be
+   skipped. */
+
+#define MAX_JOBS 16
+#define MAX_WATCHES 8
+
+struct Job {
+    const char *name;
+    JobFunc func;
+    int64_t deadline;	/* Monotonic time (ms) of next run, or NEVER. */
+    int period;		/* Milliseconds between runs, or 0 for one-shot. */
+};
+
+static struct Job jobs[MAX_JOBS];
+static int numJobs;
+
+struct Watch {
+    const char *name;
+    int fd;
+    JobFunc func;
+};
+
+static struct Watch watches[MAX_WATCHES];
+static int numWatches;
+
+static int epollFd = -1, timerFd = -1;
+static volatile sig_atomic_t running;
+
+static bool virtualClock = false;
+static int64_t virtualNow;
+
+static struct SchedulerStats stats;
+
+bool InitScheduler( void )
+{
+    numJobs = numWatches = 0;
+
+    if( (epollFd = epoll_create1(EPOLL_CLOEXEC)) < 0 )
+	return( false );
+    if( (timerFd = timerfd_create(CLOCK_MONOTONIC,
+				  TFD_NONBLOCK | TFD_CLOEXEC)) < 0 )
+	return( false );
+
+    struct epoll_event ev = { .events = EPOLLIN, .data.fd = timerFd };
+    return( epoll_ctl(epollFd,EPOLL_CTL_ADD,timerFd,&ev) == 0 );
+}
+
+int64_t NowMs( void )
+{
+    if( virtualClock )
+	return( virtualNow );
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC,&ts);
+    return( (int64_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000 );
+}
+
+void UseVirtualClock( void )
+{
+    virtualClock = true;
+    virtualNow = 0;
+}
+
+/* Return the time in microseconds according to the monotonic clock. */
+static int64_t nowUs( void )
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC,&ts);
+    return( (int64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000 );
+}
+
+/* Add a time in microseconds to a histogram. */
+static void addToHistogram( uint32_t *histogram, int64_t us )
+{
+    int bucket = 0;
+    while( us > 1 && bucket < STATS_BUCKETS - 1 ) {
+	us >>= 1;
+	++bucket;
+    }
+    ++histogram[bucket];
+}
+
+/* Call a job or watch function, and note how long it took. */
+static void run( const char *name, JobFunc func )
+{
+    int64_t start = nowUs();
+    func();
+    int64_t us = nowUs() - start;
+
+    addToHistogram(stats.runTime,us);
+    if( us > stats.worstStall ) {
+	stats.worstStall = us;
+	stats.worstStallCause = name;
+    }
+}
+
+int AddJob( const char *name, JobFunc func, int64_t deadline, int period )
+{
+    if( numJobs >= MAX_JOBS )
+	return( -1 );
+    jobs[numJobs].name = name;
+    jobs[numJobs].func = func;
+    jobs[numJobs].deadline = deadline;
+    jobs[numJobs].period = period;
+    return( numJobs++ );
+}
+
+void ScheduleJob( int job, int64_t deadline )
+{
+    if( 0 <= job && job < numJobs )
+	jobs[job].deadline = deadline;
+}
+
+int64_t GetJobDeadline( int job )
+{
+    return( 0 <= job && job < numJobs ? jobs[job].deadline : NEVER );
+}
+
+bool AddWatch( const char *name, int fd, JobFunc func )
+{
+    if( numWatches >= MAX_WATCHES )
+        return( false );
+
+    struct epoll_event ev = { .events = EPOLLIN, .data.fd = fd };
+    if( epoll_ctl(epollFd,EPOLL_CTL_ADD,fd,&ev) != 0 )
+        return( false );
+
+    watches[numWatches].name = name;
+    watches[numWatches].fd = fd;
+    watches[numWatches].func = func;
+    ++numWatches;
+    return( true );
+}
+
+void StopScheduler( void )
+{
+    running = false;
+}
+
+/* Arm the timer to expire at the given deadline, or disarm it if NEVER. An
+   expiry time of zero would also disarm it, so a job scheduled ASAP by a job
+   that ran after it is given the earliest time that isn't zero, which has
+   long passed, so the timer expires right away. */
+static void armTimer( int64_t deadline )
+{
+    struct itimerspec its = { { 0, 0 }, { 0, 0 } };
+    if( deadline != NEVER ) {
+	its.it_value.tv_sec = deadline / 1000;
+	its.it_value.tv_nsec = deadline % 1000 * 1000000;
+	if( its.it_value.tv_sec == 0 && its.it_value.tv_nsec == 0 )
+	    its.it_value.tv_nsec = 1;
+    }
+    timerfd_settime(timerFd,TFD_TIMER_ABSTIME,&its,NULL);
+}
+
+void RunScheduler( void )
+{
+    running = true;
+    while( running ) {
+	++stats.cycles;
+
+	/* Run every job that is due, in the order they were added. */
+	int64_t now = NowMs();
+	for( int i = 0; i < numJobs && running; ++i ) {
+	    struct Job *job = &jobs[i];
+	    if( job->deadline > now )
+		continue;
+	    if( job->deadline != ASAP && !virtualClock )
+		addToHistogram(stats.lateness,nowUs() - job->deadline * 1000);
+
+	    /* Compute the next deadline before running the job, so that the
+	       job itself can override it. A periodic job that was run ASAP
+	       continues a period from now. Otherwise, if we've fallen more than
+	       a whole period behind, skip the missed runs instead of bunching
+	       them. */
+	    if( job->period == 0 )
+		job->deadline = NEVER;
+	    else if( job->deadline == ASAP )
+		job->deadline = now + job->period;
+	    else if( (job->deadline += job->period) <= now ) {
+		job->deadline = now + job->period;
+		++stats.missedDeadlines;
+	    }
+
+	    run(job->name,job->func);
+	}
+	if( !running )
+	    break;
+
+	/* Sleep until the earliest deadline. */
+	int64_t earliest = NEVER;
+	for( int i = 0; i < numJobs; ++i )
+	    if( jobs[i].deadline < earliest )
+		earliest = jobs[i].deadline;
+	if( virtualClock ) {
+	    if( earliest == NEVER )
+		break;
+	    if( earliest > virtualNow )
+		virtualNow = earliest;
+	    continue;
+	}
+	armTimer(earliest);
+
+	struct epoll_event events[MAX_WATCHES+1];
+	int n = epoll_wait(epollFd,events,MAX_WATCHES+1,-1);
+
+	/* Call the functions watching any descriptors that became readable.
+	   The timer only needs to be acknowledged, since due jobs are found by
+	   checking their deadlines. */
+	for( int i = 0; i < n && running; ++i ) {
+	    int fd = events[i].data.fd;
+	    if( fd == timerFd ) {
+		uint64_t expirations;
+		if( read(timerFd,&expirations,sizeof(expirations)) < 0
+		 && errno != EAGAIN )
+		    running = false;
+	    }
+	    else {
+		for( int j = 0; j < numWatches; ++j )
+		    if( watches[j].fd == fd )
+			run(watches[j].name,watches[j].func);
+	    }
+	}
+    }
+}
+
+void GetSchedulerStats( struct SchedulerStats *s )
+{
+    *s = stats;
+}
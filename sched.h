@@ -0,0 +1,81 @@
+/* PiTabDaemon - Event Scheduling */
+
+/* Copyright (c) 2017 by Stefan Vorkoetter
+
+   This file is part of PiTabDaemon.
+
+   PiTabDaemon is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   PiTabDaemon is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with PiTabDaemon. If not, see <http://www.gnu.org/licenses/>. */
+
+#ifndef __PI_TAB_DAEMON_SCHED_H__
+#define __PI_TAB_DAEMON_SCHED_H__
+
+#include <stdint.h>
+
+/* Deadlines of a job that is not currently scheduled, and of one that should
+   run as soon as possible (after any other jobs already due). */
+#define NEVER INT64_MAX
+#define ASAP  0
+
+typedef void (*JobFunc)( void );
+
+extern bool InitScheduler( void );
+
+/* Return the time in milliseconds according to the monotonic clock. */
+extern int64_t NowMs( void );
+
+/* Run on a virtual clock instead, which starts at zero and jumps straight to
+   the next deadline rather than waiting for it. Watched descriptors are not
+   waited on at all. This is for replaying traces (see replay.h). */
+extern void UseVirtualClock( void );
+
+/* Add a job that will next run at the specified deadline, and every period
+   milliseconds after that if period is non-zero. Jobs that are due at the
+   same time run in the order they were added. The name is used to report
+   what was running when the scheduler fell behind. Returns a job number, or
+   -1 if the job table is full. */
+extern int AddJob( const char *name, JobFunc func, int64_t deadline,
+		   int period );
+
+/* Change the next deadline of a job, or suspend it by passing NEVER. */
+extern void ScheduleJob( int job, int64_t deadline );
+extern int64_t GetJobDeadline( int job );
+
+/* Call func whenever the file descriptor becomes readable. Returns false if
+   the watch table is full or the descriptor can't be watched. */
+extern bool AddWatch( const char *name, int fd, JobFunc func );
+
+/* Run jobs as they become due and watch functions as their descriptors
+   become readable, sleeping in between, until StopScheduler is called from
+   within a job, watch function, or signal handler. */
+extern void RunScheduler( void );
+extern void StopScheduler( void );
+
+/* Statistics on how well the scheduler is keeping up. Times are in
+   microseconds. Bucket 0 of each histogram counts times under 2us, bucket i
+   counts times from 2^i up to 2^(i+1), and the last bucket everything
+   longer. */
+#define STATS_BUCKETS 24
+
+struct SchedulerStats {
+    uint32_t lateness[STATS_BUCKETS];	/* Job start after its deadline. */
+    uint32_t runTime[STATS_BUCKETS];	/* Time taken by each job or watch. */
+    int64_t worstStall;			/* Longest run time, */
+    const char *worstStallCause;	/* and the job or watch that took it. */
+    uint32_t missedDeadlines;		/* Periodic runs that were skipped. */
+    uint64_t cycles;			/* Passes through the scheduling loop. */
+};
+
+extern void GetSchedulerStats( struct SchedulerStats *stats );
+
+#endif
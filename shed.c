@@ -0,0 +1,113 @@
+/* PiTabDaemon - Low Battery Load Shedding */
+
+/* Copyright (c) 2017 by Stefan Vorkoetter
+
+   This file is part of PiTabDaemon.
+
+   PiTabDaemon is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   PiTabDaemon is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with PiTabDaemon. If not, see <http://www.gnu.org/licenses/>. */
+
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "logging.h"
+#include "shed.h"
+
+/* As the battery runs down, power consumption is reduced a step at a time to
+   stretch the remaining runtime before the PowerBoost's low battery output
+   forces a shutdown. Each rung of the ladder below is taken when the energy
+   remaining falls to its threshold. Turning things off lets the battery
+   voltage (and therefore the estimated energy) recover a little, so a rung is
+   only released once the charger is connected and the energy has climbed
+   some way past its threshold. Every transition is logged with the energy
+   remaining, so the runtime gained by each rung can be measured. The
+   thresholds and hysteresis below are defaults that can be configured. */
+
+struct Rung {
+    const char *name;	    /* Name used to configure the rung. */
+    double energy;	    /* Energy remaining (%) at which rung is taken. */
+    int action;		    /* SHED_ bit for the rung. */
+    const char *what;	    /* Description for the log. */
+};
+
+static struct Rung ladder[] = {
+    { "brightness", 30, SHED_BRIGHTNESS, "display brightness limit" },
+    { "idle", 20, SHED_IDLE, "shorter idle timeout" },
+    { "usb", 15, SHED_USB, "USB power off" },
+    { "wifi", 10, SHED_WIFI, "Wi-Fi off" },
+    { "cpu",  5, SHED_CPU, "CPU power saving" }
+};
+static const int NUM_RUNGS = sizeof(ladder) / sizeof(struct Rung);
+
+/* Energy (%) above a rung's threshold before it is released. */
+static double hysteresis = 5;
+
+static int shedding = 0;
+
+bool ConfigureLoadShedding( const char *spec )
+{
+    const char *equals = strchr(spec,'=');
+    if( equals == NULL )
+	return( false );
+    char *end;
+    double percent = strtod(equals + 1,&end);
+    if( end == equals + 1 || *end != '\0' || percent < 0 || percent > 100 )
+	return( false );
+
+    size_t length = equals - spec;
+    if( length == strlen("hysteresis")
+     && strncmp(spec,"hysteresis",length) == 0 ) {
+	hysteresis = percent;
+	return( true );
+    }
+    for( int i = 0; i < NUM_RUNGS; ++i ) {
+	struct Rung *rung = &ladder[i];
+	if( strlen(rung->name) == length
+	 && strncmp(rung->name,spec,length) == 0 ) {
+	    rung->energy = percent;
+	    return( true );
+	}
+    }
+    return( false );
+}
+
+int UpdateLoadShedding( double energy, bool pluggedIn )
+{
+    for( int i = 0; i < NUM_RUNGS; ++i ) {
+	const struct Rung *rung = &ladder[i];
+	if( !(shedding & rung->action) && !pluggedIn
+	 && energy <= rung->energy )
+	{
+	    shedding |= rung->action;
+	    WriteToLogF("load shedding: %s at %1.0f%%",rung->what,energy);
+	}
+	else if( (shedding & rung->action) && pluggedIn
+	      && energy >= rung->energy + hysteresis )
+	{
+	    shedding &= ~rung->action;
+	    WriteToLogF("load restored: %s at %1.0f%%",rung->what,energy);
+	}
+    }
+    return( shedding );
+}
+
+int GetLoadShedding( void )
+{
+    return( shedding );
+}
+
+void SetLoadShedding( int actions )
+{
+    shedding = actions;
+}
@@ -0,0 +1,46 @@
+/* PiTabDaemon - Low Battery Load Shedding */
+
+/* Copyright (c) 2017 by Stefan Vorkoetter
+
+   This file is part of PiTabDaemon.
+
+   PiTabDaemon is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   PiTabDaemon is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with PiTabDaemon. If not, see <http://www.gnu.org/licenses/>. */
+
+#ifndef __PI_TAB_DAEMON_SHED_H__
+#define __PI_TAB_DAEMON_SHED_H__
+
+/* Ways of reducing power consumption, as bits in a mask. */
+#define SHED_BRIGHTNESS	0x01	/* Limit the display brightness. */
+#define SHED_IDLE	0x02	/* Dim the display sooner when idle. */
+#define SHED_USB	0x04	/* Turn off USB, Ethernet, and Bluetooth. */
+#define SHED_WIFI	0x08	/* Turn off Wi-Fi. */
+#define SHED_CPU	0x10	/* Switch the CPU to power saving mode. */
+
+/* Configure load shedding from a specification of the form "rung=percent",
+   where rung is brightness, idle, usb, wifi, or cpu, and percent is the
+   energy remaining at which it is taken, or "hysteresis=percent", the energy
+   above its threshold that must be regained before a rung is released.
+   Returns false if the specification isn't valid. */
+extern bool ConfigureLoadShedding( const char *spec );
+
+/* Given the estimated energy remaining (0 to 100) and whether the charger is
+   connected, return the mask of ways in which power consumption should now
+   be reduced. */
+extern int UpdateLoadShedding( double energy, bool pluggedIn );
+
+/* Return or restore the current mask (e.g. after a restart). */
+extern int GetLoadShedding( void );
+extern void SetLoadShedding( int actions );
+
+#endif
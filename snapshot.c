@@ -0,0 +1,112 @@
+/* PiTabDaemon - Warm Restart Snapshots */
+
+/* Copyright (c) 2017 by Stefan Vorkoetter
+
+   This file is part of PiTabDaemon.
+
+   PiTabDaemon is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   PiTabDaemon is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with PiTabDaemon. If not, see <http://www.gnu.org/licenses/>. */
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "battery.h"
+#include "display.h"
+#include "io.h"
+#include "sched.h"
+#include "snapshot.h"
+
+/* When the daemon is reinvoked, the running instance is told to terminate,
+   and it saves everything the new instance needs to carry on where it left
+   off in a snapshot on the RAM disk. The snapshot starts with a header
+   identifying the format and recording when it was written, so that one from
+   a different version of the daemon, or one that has been lying around for a
+   while, is ignored. The RAM disk is empty after a reboot, so the monotonic
+   clock can be used to measure the snapshot's age. */
+
+#define SNAPSHOT_FILE	"/ram/pitabd.state"
+#define SNAPSHOT_TEMP	"/ram/pitabd.state.tmp"
+
+#define SNAPSHOT_MAGIC	0x50544453	/* "PTDS" */
+#define SNAPSHOT_VERSION 2
+
+/* Maximum age in ms of a snapshot that will be loaded. */
+#define SNAPSHOT_MAX_AGE 10000
+
+struct SnapshotHeader {
+    uint32_t magic, version;
+    int64_t time;
+};
+
+bool SaveSnapshot( const struct DaemonState *state )
+{
+    struct SnapshotHeader header = { SNAPSHOT_MAGIC, SNAPSHOT_VERSION, NowMs() };
+    struct BrightnessState brightness;
+    struct InputState inputs;
+    GetBrightnessState(&brightness);
+    GetInputState(&inputs);
+
+    /* Write to a temporary file and then rename it, so the new instance
+       never sees a partial snapshot. */
+    FILE *fp = fopen(SNAPSHOT_TEMP,"w");
+    if( fp == NULL )
+	return( false );
+    bool ok = fwrite(&header,sizeof(header),1,fp) == 1
+	   && fwrite(state,sizeof(*state),1,fp) == 1
+	   && fwrite(&brightness,sizeof(brightness),1,fp) == 1
+	   && fwrite(&inputs,sizeof(inputs),1,fp) == 1
+	   && WriteBatteryState(fp);
+    if( fclose(fp) != 0 || !ok || rename(SNAPSHOT_TEMP,SNAPSHOT_FILE) != 0 ) {
+	unlink(SNAPSHOT_TEMP);
+	return( false );
+    }
+    return( true );
+}
+
+bool LoadSnapshot( struct DaemonState *state )
+{
+    FILE *fp = fopen(SNAPSHOT_FILE,"r");
+    if( fp == NULL )
+	return( false );
+    unlink(SNAPSHOT_FILE);
+
+    /* Read everything but the battery state before changing anything, so
+       that an unusable snapshot is ignored completely. */
+    struct SnapshotHeader header;
+    struct DaemonState saved;
+    struct BrightnessState brightness;
+    struct InputState inputs;
+    if( fread(&header,sizeof(header),1,fp) != 1
+     || header.magic != SNAPSHOT_MAGIC || header.version != SNAPSHOT_VERSION
+     || NowMs() - header.time > SNAPSHOT_MAX_AGE
+     || fread(&saved,sizeof(saved),1,fp) != 1
+     || fread(&brightness,sizeof(brightness),1,fp) != 1
+     || fread(&inputs,sizeof(inputs),1,fp) != 1 )
+    {
+	fclose(fp);
+	return( false );
+    }
+
+    *state = saved;
+    SetBrightnessState(&brightness);
+    SetInputState(&inputs);
+
+    /* The battery readings start over if they were made with a different
+       estimator, but everything else is still good. */
+    ReadBatteryState(fp);
+    fclose(fp);
+    return( true );
+}
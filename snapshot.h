@@ -0,0 +1,44 @@
+/* PiTabDaemon - Warm Restart Snapshots */
+
+/* Copyright (c) 2017 by Stefan Vorkoetter
+
+   This file is part of PiTabDaemon.
+
+   PiTabDaemon is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   PiTabDaemon is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with PiTabDaemon. If not, see <http://www.gnu.org/licenses/>. */
+
+#ifndef __PI_TAB_DAEMON_SNAPSHOT_H__
+#define __PI_TAB_DAEMON_SNAPSHOT_H__
+
+/* State kept by the main program that is preserved across a restart. The
+   state of the battery readings, inputs, and display brightness is saved and
+   restored along with it. */
+struct DaemonState {
+    double lastVoltage, lastEnergy;
+    int displayState;
+    int64_t lowBatteryTime;	/* Time left (ms) before LBO shutdown, or -1. */
+    bool charging, completed, pluggedIn;
+    bool usbOn, wifiOn, allowDim;
+    int shedding;
+};
+
+/* Save a snapshot of the daemon's state to the RAM disk when it is being
+   terminated so that it can be restarted. */
+extern bool SaveSnapshot( const struct DaemonState *state );
+
+/* Restore the state from a snapshot left by the previous instance of the
+   daemon, if there is one and it is recent. The snapshot is removed, so it
+   can only be loaded once. */
+extern bool LoadSnapshot( struct DaemonState *state );
+
+#endif
@@ -0,0 +1,226 @@
+/* PiTabDaemon - Shared Memory Status Block */
+
+/* Copyright (c) 2017 by Stefan Vorkoetter
+
+   This file is part of PiTabDaemon.
+
+   PiTabDaemon is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   PiTabDaemon is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with PiTabDaemon. If not, see <http://www.gnu.org/licenses/>. */
+
+#define _GNU_SOURCE
+
+#include <fcntl.h>
+#include <limits.h>
+#include <sched.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <linux/futex.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+
+#include "status.h"
+
+/* The fences make sure the odd sequence number is seen before any of the
+   status changes, and all of them before the next even one, even on a
+   processor that reorders memory accesses (such as the Pi's ARM). */
+
+static struct StatusBlock *block = NULL;
+
+/* Number of times a reader tries to get a consistent copy, which only fails
+   if the daemon dies in the middle of an update. */
+#define READ_ATTEMPTS 1000
+
+bool InitStatus( const char *path )
+{
+    int fd = open(path,O_RDWR | O_CREAT | O_CLOEXEC,0644);
+    if( fd < 0 )
+	return( false );
+    fchmod(fd,0644);
+    if( ftruncate(fd,sizeof(struct StatusBlock)) < 0 ) {
+	close(fd);
+	return( false );
+    }
+    block = mmap(NULL,sizeof(struct StatusBlock),PROT_READ | PROT_WRITE,
+		 MAP_SHARED,fd,0);
+    close(fd);
+    if( block == MAP_FAILED ) {
+	block = NULL;
+	return( false );
+    }
+
+    /* If a previous instance left a block behind, carry on from where it
+       left off, so that readers that still have it mapped see the changes
+       as just another update, even if it died in the middle of one. */
+    if( block->magic != STATUS_MAGIC || block->version != STATUS_VERSION ) {
+	memset(block,0,sizeof(struct StatusBlock));
+	block->magic = STATUS_MAGIC;
+	block->version = STATUS_VERSION;
+    }
+    if( block->sequence & 1 )
+	__atomic_store_n(&block->sequence,block->sequence + 1,
+			 __ATOMIC_RELEASE);
+    return( true );
+}
+
+void PublishStatus( const struct Status *status )
+{
+    if( block == NULL )
+	return;
+
+    uint32_t seq = block->sequence;
+    __atomic_store_n(&block->sequence,seq + 1,__ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    memcpy(&block->status,status,sizeof(struct Status));
+    __atomic_store_n(&block->sequence,seq + 2,__ATOMIC_RELEASE);
+
+    /* Wake up any readers waiting for the next generation. */
+    __atomic_add_fetch(&block->generation,1,__ATOMIC_RELEASE);
+    syscall(SYS_futex,&block->generation,FUTEX_WAKE,INT_MAX,NULL,NULL,0);
+}
+
+const struct StatusBlock *OpenStatus( const char *path )
+{
+    int fd = open(path,O_RDONLY | O_CLOEXEC);
+    if( fd < 0 )
+	return( NULL );
+    struct StatusBlock *b = mmap(NULL,sizeof(struct StatusBlock),PROT_READ,
+				 MAP_SHARED,fd,0);
+    close(fd);
+    if( b == MAP_FAILED )
+	return( NULL );
+    if( b->magic != STATUS_MAGIC || b->version != STATUS_VERSION ) {
+	munmap(b,sizeof(struct StatusBlock));
+	return( NULL );
+    }
+    return( b );
+}
+
+bool ReadStatus( const struct StatusBlock *b, struct Status *status,
+		 uint32_t *generation )
+{
+    for( int attempt = 0; attempt < READ_ATTEMPTS; ++attempt ) {
+	uint32_t seq = __atomic_load_n(&b->sequence,__ATOMIC_ACQUIRE);
+	if( seq & 1 ) {
+	    sched_yield();
+	    continue;
+	}
+	*generation = __atomic_load_n(&b->generation,__ATOMIC_RELAXED);
+	memcpy(status,(const void *) &b->status,sizeof(struct Status));
+	__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	if( __atomic_load_n(&b->sequence,__ATOMIC_RELAXED) == seq )
+	    return( true );
+    }
+    return( false );
+}
+
+bool WaitForStatus( const struct StatusBlock *b, uint32_t generation,
+		    int timeoutMs )
+{
+    struct timespec ts = { timeoutMs / 1000, timeoutMs % 1000 * 1000000 };
+    if( __atomic_load_n(&b->generation,__ATOMIC_ACQUIRE) == generation )
+	syscall(SYS_futex,&b->generation,FUTEX_WAIT,generation,
+		timeoutMs < 0 ? NULL : &ts,NULL,0);
+    return( __atomic_load_n(&b->generation,__ATOMIC_ACQUIRE) != generation );
+}
+
+/* The sequence lock is checked by having a child process publish a long
+   series of updates as fast as it can, while this process reads them as
+   fast as it can. Every field of update n is derived from n, so a copy with
+   fields from two different updates (a torn read) shows up as fields that
+   don't agree with each other, and a copy of an older update than one
+   already read shows up as n going backwards. */
+
+#define CHECK_UPDATES 500000
+
+static void makeCheckStatus( struct Status *status, int32_t n )
+{
+    memset(status,0,sizeof(struct Status));
+    status->voltage = n;
+    status->energy = n / 2.0;
+    status->charging = n;
+    status->completed = -n;
+    status->brightnessIndex = n ^ 0x5555;
+    status->displayState = n + 1;
+    status->usbOn = n - 1;
+    status->wifiOn = ~n;
+    status->allowDim = n * 3;
+    status->worstStall = n;
+    status->missedDeadlines = n;
+}
+
+bool CheckStatusSeqlock( void )
+{
+    char path[] = "/tmp/pitabd.status.XXXXXX";
+    int fd = mkstemp(path);
+    if( fd < 0 )
+	return( false );
+    close(fd);
+
+    const struct StatusBlock *b;
+    struct Status status;
+    if( !InitStatus(path) || (b = OpenStatus(path)) == NULL ) {
+	unlink(path);
+	return( false );
+    }
+    makeCheckStatus(&status,0);
+    PublishStatus(&status);
+
+    /* Anything still buffered would otherwise be written twice. */
+    fflush(stdout);
+    pid_t pid = fork();
+    if( pid == 0 ) {
+	for( int32_t n = 1; n <= CHECK_UPDATES; ++n ) {
+	    makeCheckStatus(&status,n);
+	    PublishStatus(&status);
+	}
+	_exit(0);
+    }
+
+    /* Keep reading until after the writer has finished, so that the last
+       read sees its final update. */
+    long reads = 0, torn = 0, backwards = 0, failed = 0;
+    int32_t last = 0;
+    int wstatus;
+    bool finished = pid <= 0;
+    while( !finished ) {
+	finished = waitpid(pid,&wstatus,WNOHANG) != 0;
+	uint32_t generation;
+	struct Status expected;
+	if( !ReadStatus(b,&status,&generation) ) {
+	    ++failed;
+	    continue;
+	}
+	++reads;
+	int32_t n = status.voltage;
+	makeCheckStatus(&expected,n);
+	if( memcmp(&status,&expected,sizeof(status)) != 0 )
+	    ++torn;
+	else if( n < last )
+	    ++backwards;
+	else
+	    last = n;
+    }
+    printf("status seqlock: %ld reads of %d updates, %ld torn, %ld out of "
+	   "order, %ld gave up\n",reads,CHECK_UPDATES,torn,backwards,failed);
+
+    munmap((void *) b,sizeof(struct StatusBlock));
+    unlink(path);
+    return( pid > 0 && last == CHECK_UPDATES && torn == 0 && backwards == 0 );
+}
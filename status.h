@@ -0,0 +1,80 @@
+/* PiTabDaemon - Shared Memory Status Block */
+
+/* Copyright (c) 2017 by Stefan Vorkoetter
+
+   This file is part of PiTabDaemon.
+
+   PiTabDaemon is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   PiTabDaemon is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with PiTabDaemon. If not, see <http://www.gnu.org/licenses/>. */
+
+#ifndef __PI_TAB_DAEMON_STATUS_H__
+#define __PI_TAB_DAEMON_STATUS_H__
+
+#include <stdint.h>
+
+/* The daemon publishes its status to the dashboard in a small file on the
+   RAM disk that both of them map into memory. The daemon updates it in place
+   under a sequence lock: the sequence number is odd while an update is in
+   progress, so a reader that sees the same even sequence number before and
+   after copying the status knows its copy is consistent, and otherwise just
+   tries again. The reader never blocks the daemon. After each update the
+   generation number is incremented, and a reader can sleep until that
+   happens by waiting on it as a futex. The dashboard can use the reader
+   functions below by building status.c along with its own code. */
+#define STATUS_FILE	"/ram/pitabd.status"
+#define STATUS_MAGIC	0x50544253
+#define STATUS_VERSION	2
+
+struct Status {
+    double voltage;		/* Battery voltage. */
+    double energy;		/* Estimated energy remaining (%). */
+    int32_t charging, completed;
+    int32_t brightnessIndex;	/* 0 to 8, as in the command file. */
+    int32_t displayState;	/* 0 = active, 1 = dim, 2 = dark. */
+    int32_t usbOn, wifiOn, allowDim;
+    int32_t worstStall;		/* Longest time (us) the daemon was busy, */
+    uint32_t missedDeadlines;	/* and times it fell behind (see sched.h). */
+};
+
+struct StatusBlock {
+    uint32_t magic, version;
+    uint32_t sequence;
+    uint32_t generation;
+    struct Status status;
+};
+
+/* Create (or take over) the status block, and publish a new status. */
+extern bool InitStatus( const char *path );
+extern void PublishStatus( const struct Status *status );
+
+/* Map an existing status block for reading, returning NULL if it doesn't
+   exist or isn't one. */
+extern const struct StatusBlock *OpenStatus( const char *path );
+
+/* Make a consistent copy of the current status, and get the generation it
+   belongs to. Returns false if the daemon died while updating it. */
+extern bool ReadStatus( const struct StatusBlock *block,
+			struct Status *status, uint32_t *generation );
+
+/* Wait for up to the specified time (or indefinitely if negative) for the
+   status to be updated after the specified generation. Returns true if it
+   has been. */
+extern bool WaitForStatus( const struct StatusBlock *block,
+			   uint32_t generation, int timeoutMs );
+
+/* Check that readers never get a torn or out of date copy of the status
+   while it's being updated by another process, using a temporary status
+   block, and print the result. Returns false if they do. */
+extern bool CheckStatusSeqlock( void );
+
+#endif
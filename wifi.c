@@ -0,0 +1,135 @@
+/* PiTabDaemon - Wi-Fi Radio Control */
+
+/* Copyright (c) 2017 by Stefan Vorkoetter
+
+   This file is part of PiTabDaemon.
+
+   PiTabDaemon is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   PiTabDaemon is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with PiTabDaemon. If not, see <http://www.gnu.org/licenses/>. */
+
+#define _GNU_SOURCE
+
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <linux/rfkill.h>
+
+#include "replay.h"
+#include "wifi.h"
+
+/* The Wi-Fi radio is turned on and off by soft blocking it through the
+   kernel's rfkill interface, which is what cfg80211 (and so nl80211) uses to
+   power the radio down. A single write to /dev/rfkill changes every Wi-Fi
+   radio, and the kernel then reports the new state of each one as an event
+   on the same descriptor, so the daemon can confirm the change without
+   waiting for it. The radios of the mac80211_hwsim driver are rfkill devices
+   too, so this can be tried out without real hardware. */
+
+#define RFKILL_DEVICE "/dev/rfkill"
+
+/* State of each Wi-Fi radio, indexed by rfkill index. */
+#define MAX_RADIOS 8
+
+static struct {
+    uint32_t idx;
+    bool soft, hard;	/* Blocked by software or by a switch. */
+} radios[MAX_RADIOS];
+
+static int numRadios = 0;
+
+static int rfkillFd = -1;
+static bool wantOn = true;
+
+bool InitWifi( void )
+{
+    if( (rfkillFd = open(RFKILL_DEVICE,O_RDWR | O_NONBLOCK | O_CLOEXEC)) < 0 )
+	return( false );
+
+    /* The kernel starts by reporting every radio that already exists. */
+    ReadWifiEvents();
+    wantOn = IsWifiOn();
+    return( true );
+}
+
+int GetWifiFd( void )
+{
+    return( rfkillFd );
+}
+
+void RequestWifi( bool on )
+{
+    struct rfkill_event event = { 0 };
+    event.type = RFKILL_TYPE_WLAN;
+    event.op = RFKILL_OP_CHANGE_ALL;
+    event.soft = !on;
+    wantOn = on;
+    if( Replaying() )
+	ReplayOutput("wifi %s",on ? "on" : "off");
+    if( rfkillFd >= 0 )
+	write(rfkillFd,&event,RFKILL_EVENT_SIZE_V1);
+}
+
+bool ReadWifiEvents( void )
+{
+    struct rfkill_event event;
+    while( rfkillFd >= 0
+	&& read(rfkillFd,&event,RFKILL_EVENT_SIZE_V1) == RFKILL_EVENT_SIZE_V1 )
+    {
+	if( event.type != RFKILL_TYPE_WLAN )
+	    continue;
+
+	int i = 0;
+	while( i < numRadios && radios[i].idx != event.idx )
+	    ++i;
+
+	if( event.op == RFKILL_OP_DEL ) {
+	    if( i < numRadios )
+		radios[i] = radios[--numRadios];
+	}
+	else if( i < MAX_RADIOS ) {
+	    if( i == numRadios )
+		++numRadios;
+	    radios[i].idx = event.idx;
+	    radios[i].soft = event.soft;
+	    radios[i].hard = event.hard;
+	}
+    }
+    return( IsWifiSettled() );
+}
+
+bool IsWifiOn( void )
+{
+    if( Replaying() )
+	return( wantOn );
+    for( int i = 0; i < numRadios; ++i )
+	if( !radios[i].soft && !radios[i].hard )
+	    return( true );
+    return( false );
+}
+
+bool IsWifiSettled( void )
+{
+    /* The radio is taken to do as it's told when replaying a trace. */
+    if( Replaying() )
+	return( true );
+    if( rfkillFd < 0 )
+	return( false );
+
+    /* A radio blocked by a switch can't be turned on, whatever its soft
+       block says. */
+    for( int i = 0; i < numRadios; ++i )
+	if( radios[i].soft == wantOn || wantOn && radios[i].hard )
+	    return( false );
+    return( IsWifiOn() == wantOn );
+}
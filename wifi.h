@@ -0,0 +1,45 @@
+/* PiTabDaemon - Wi-Fi Radio Control */
+
+/* Copyright (c) 2017 by Stefan Vorkoetter
+
+   This file is part of PiTabDaemon.
+
+   PiTabDaemon is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   PiTabDaemon is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with PiTabDaemon. If not, see <http://www.gnu.org/licenses/>. */
+
+#ifndef __PI_TAB_DAEMON_WIFI_H__
+#define __PI_TAB_DAEMON_WIFI_H__
+
+/* Open the rfkill device and find out the current state of the Wi-Fi radios.
+   Returns false if rfkill isn't available. */
+extern bool InitWifi( void );
+
+/* Return a file descriptor that becomes readable when the state of a radio
+   changes, or -1 if not initialized. */
+extern int GetWifiFd( void );
+
+/* Ask for the Wi-Fi radios to be turned on or off. This doesn't wait for the
+   change to take effect. */
+extern void RequestWifi( bool on );
+
+/* Read any radio state changes. Returns true if the radios are now in the
+   state that was last requested. */
+extern bool ReadWifiEvents( void );
+
+/* Return true if any Wi-Fi radio is on, and true if the radios are all in
+   the state that was last requested (which they can't be if rfkill isn't
+   available, and aren't if asked to turn on while a switch blocks them). */
+extern bool IsWifiOn( void );
+extern bool IsWifiSettled( void );
+
+#endif
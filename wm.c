@@ -0,0 +1,236 @@
+/* PiTabDaemon - Window Management */
+
+/* Copyright (c) 2017 by Stefan Vorkoetter
+
+   This file is part of PiTabDaemon.
+
+   PiTabDaemon is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   PiTabDaemon is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with PiTabDaemon. If not, see <http://www.gnu.org/licenses/>. */
+
+#define _GNU_SOURCE
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <X11/Xatom.h>
+#include <X11/Xlib.h>
+
+#include "replay.h"
+#include "wm.h"
+#include "x11.h"
+
+/* Windows are moved, resized, and raised by asking the window manager to do
+   it, using the same EWMH client messages that wmctrl sends, but over the
+   daemon's own X connection instead of starting a shell and wmctrl (which
+   opens its own connection) for every operation. */
+
+enum { NET_ACTIVE_WINDOW, NET_CLIENT_LIST, NET_WM_NAME, NET_WM_STATE,
+       NET_WM_STATE_FULLSCREEN, NET_WM_STATE_MAXIMIZED_VERT,
+       NET_WM_STATE_MAXIMIZED_HORZ, UTF8_STRING, NUM_ATOMS };
+
+static char *ATOM_NAMES[NUM_ATOMS] = {
+    "_NET_ACTIVE_WINDOW", "_NET_CLIENT_LIST", "_NET_WM_NAME", "_NET_WM_STATE",
+    "_NET_WM_STATE_FULLSCREEN", "_NET_WM_STATE_MAXIMIZED_VERT",
+    "_NET_WM_STATE_MAXIMIZED_HORZ", "UTF8_STRING"
+};
+
+static Atom atoms[NUM_ATOMS];
+
+/* Actions for _NET_WM_STATE messages. */
+#define STATE_REMOVE 0
+#define STATE_ADD    1
+#define STATE_TOGGLE 2
+
+/* Source indication in client messages: we're acting for the user, like a
+   pager, so the window manager shouldn't second guess us. */
+#define SOURCE_PAGER 2
+
+/* Windows that were last found for each title that was asked for, so the
+   client list only needs to be searched if a window goes away or changes its
+   title. */
+#define MAX_CACHED 4
+
+static struct {
+    const char *title;
+    Window window;
+} cache[MAX_CACHED];
+
+static int numCached = 0;
+
+/* Return the X connection, with the atoms we need looked up. */
+static Display *getDisplay( void )
+{
+    static bool haveAtoms = false;
+    Display *display = GetX11Display();
+    if( display != NULL && !haveAtoms )
+	haveAtoms = XInternAtoms(display,ATOM_NAMES,NUM_ATOMS,False,atoms);
+    return( haveAtoms ? display : NULL );
+}
+
+/* Get a property of a window consisting of a list of items of the specified
+   type. Returns the number of items, and the items themselves, which must be
+   freed with XFree, or 0 if there are none. */
+static unsigned long getProperty( Display *display, Window window,
+				  Atom property, Atom type,
+				  unsigned char **items )
+{
+    Atom actualType;
+    int format;
+    unsigned long numItems, remaining;
+    *items = NULL;
+    X11ErrorOccurred();
+    if( XGetWindowProperty(display,window,property,0,1024,False,type,
+			   &actualType,&format,&numItems,&remaining,items)
+	!= Success || X11ErrorOccurred() || actualType != type )
+    {
+	if( *items != NULL )
+	    XFree(*items);
+	*items = NULL;
+	return( 0 );
+    }
+    return( numItems );
+}
+
+/* Return true if the window's title contains the specified text. */
+static bool titleMatches( Display *display, Window window, const char *title )
+{
+    unsigned char *name;
+    bool matches = false;
+    if( getProperty(display,window,atoms[NET_WM_NAME],atoms[UTF8_STRING],&name)
+     || getProperty(display,window,XA_WM_NAME,XA_STRING,&name) )
+    {
+	matches = strcasestr((char *) name,title) != NULL;
+	XFree(name);
+    }
+    return( matches );
+}
+
+/* Find the window with the specified title, using the cache if possible. */
+static Window findWindow( Display *display, const char *title )
+{
+    int c;
+    for( c = 0; c < numCached; ++c )
+	if( strcmp(cache[c].title,title) == 0 )
+	    break;
+    if( c < numCached && cache[c].window != None
+     && titleMatches(display,cache[c].window,title) )
+	return( cache[c].window );
+
+    /* Search the window manager's list of client windows. */
+    Window *clients, found = None;
+    unsigned long numClients = getProperty(display,DefaultRootWindow(display),
+					   atoms[NET_CLIENT_LIST],XA_WINDOW,
+					   (unsigned char **) &clients);
+    for( unsigned long i = 0; i < numClients && found == None; ++i )
+	if( titleMatches(display,clients[i],title) )
+	    found = clients[i];
+    if( clients != NULL )
+	XFree(clients);
+
+    /* Remember what we found for next time. */
+    if( c == numCached && numCached < MAX_CACHED )
+	cache[numCached++].title = title;
+    if( c < numCached )
+	cache[c].window = found;
+    return( found );
+}
+
+/* Send a client message about a window to the root window, where the window
+   manager will see it. */
+static void sendMessage( Display *display, Window window, Atom type,
+			 long data0, long data1, long data2, long data3 )
+{
+    XEvent event;
+    memset(&event,0,sizeof(event));
+    event.xclient.type = ClientMessage;
+    event.xclient.send_event = True;
+    event.xclient.window = window;
+    event.xclient.message_type = type;
+    event.xclient.format = 32;
+    event.xclient.data.l[0] = data0;
+    event.xclient.data.l[1] = data1;
+    event.xclient.data.l[2] = data2;
+    event.xclient.data.l[3] = data3;
+    XSendEvent(display,DefaultRootWindow(display),False,
+	       SubstructureRedirectMask | SubstructureNotifyMask,&event);
+}
+
+bool ActivateWindow( const char *title )
+{
+    if( Replaying() ) {
+	ReplayOutput("activate window %s",title);
+	return( true );
+    }
+
+    Display *display = getDisplay();
+    if( display == NULL )
+	return( false );
+
+    Window window = findWindow(display,title);
+    if( window == None )
+	return( false );
+
+    sendMessage(display,window,atoms[NET_ACTIVE_WINDOW],SOURCE_PAGER,
+		CurrentTime,0,0);
+    XMapRaised(display,window);
+    XFlush(display);
+    return( true );
+}
+
+/* Add, remove, or toggle one or two (unless property2 is -1) properties of
+   the active window. What describes the change when replaying a trace. */
+static void changeActiveWindowState( const char *what, int action,
+				     int property1, int property2 )
+{
+    if( Replaying() ) {
+	ReplayOutput("%s",what);
+	return;
+    }
+
+    Display *display = getDisplay();
+    if( display == NULL )
+	return;
+
+    Window *active;
+    if( getProperty(display,DefaultRootWindow(display),
+		    atoms[NET_ACTIVE_WINDOW],XA_WINDOW,
+		    (unsigned char **) &active) == 0 )
+	return;
+
+    if( *active != None ) {
+	sendMessage(display,*active,atoms[NET_WM_STATE],action,
+		    atoms[property1],property2 >= 0 ? atoms[property2] : 0,
+		    SOURCE_PAGER);
+	XFlush(display);
+    }
+    XFree(active);
+}
+
+void RemoveFullscreen( void )
+{
+    changeActiveWindowState("remove fullscreen",STATE_REMOVE,
+			    NET_WM_STATE_FULLSCREEN,-1);
+}
+
+void ToggleFullscreen( void )
+{
+    changeActiveWindowState("toggle fullscreen",STATE_TOGGLE,
+			    NET_WM_STATE_FULLSCREEN,-1);
+}
+
+void ToggleMaximized( void )
+{
+    changeActiveWindowState("toggle maximized",STATE_TOGGLE,
+			    NET_WM_STATE_MAXIMIZED_VERT,
+			    NET_WM_STATE_MAXIMIZED_HORZ);
+}
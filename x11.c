@@ -0,0 +1,57 @@
+/* PiTabDaemon - X11 Connection */
+
+/* Copyright (c) 2017 by Stefan Vorkoetter
+
+   This file is part of PiTabDaemon.
+
+   PiTabDaemon is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   PiTabDaemon is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with PiTabDaemon. If not, see <http://www.gnu.org/licenses/>. */
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <X11/Xlib.h>
+
+#include "replay.h"
+#include "x11.h"
+
+/* The daemon keeps a single connection to the X server for everything it
+   does with X (idle time, window management, and so on), opened the first
+   time it's needed. Requests on windows that have since been destroyed are
+   expected, so errors are recorded rather than terminating the daemon. */
+
+static Display *display = NULL;
+static bool errorOccurred = false;
+
+static int handleError( Display *d, XErrorEvent *error )
+{
+    errorOccurred = true;
+    return( 0 );
+}
+
+Display *GetX11Display( void )
+{
+    /* A trace being replayed has nothing to do with whatever X server
+       happens to be running. */
+    if( Replaying() )
+	return( NULL );
+    if( display == NULL && (display = XOpenDisplay(":0.0")) != NULL )
+	XSetErrorHandler(handleError);
+    return( display );
+}
+
+bool X11ErrorOccurred( void )
+{
+    bool occurred = errorOccurred;
+    errorOccurred = false;
+    return( occurred );
+}
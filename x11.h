@@ -0,0 +1,30 @@
+/* PiTabDaemon - X11 Connection */
+
+/* Copyright (c) 2017 by Stefan Vorkoetter
+
+   This file is part of PiTabDaemon.
+
+   PiTabDaemon is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   PiTabDaemon is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with PiTabDaemon. If not, see <http://www.gnu.org/licenses/>. */
+
+#ifndef __PI_TAB_DAEMON_X11_H__
+#define __PI_TAB_DAEMON_X11_H__
+
+/* Return the daemon's connection to the X server, connecting first if
+   necessary, or NULL if the X server isn't running (yet). */
+extern Display *GetX11Display( void );
+
+/* Return true if an X request has failed since the last call. */
+extern bool X11ErrorOccurred( void );
+
+#endif